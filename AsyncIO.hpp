@@ -0,0 +1,476 @@
+/**
+ * shark - Mapping-free filtering of useless RNA-Seq reads
+ * Copyright (C) 2020 Tamara Ceccato, Luca Denti, Yuri Pirola, Marco Previtali
+ *
+ * This file is part of shark.
+ *
+ * shark is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shark is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shark; see the file LICENSE. If not, see
+ * <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef ASYNC_IO_HPP
+#define ASYNC_IO_HPP
+
+/**
+ * Asynchronous input and output of the samples through io_uring, on
+ * Linux (built with make IO_URING=1). Regular files are read and
+ * written in blocks of BLOCK_BYTES bytes, with QUEUE_DEPTH blocks in
+ * flight, so that the latency of the storage is hidden behind the
+ * parsing and the analysis. Anything else (standard input, pipes) and
+ * kernels without io_uring are left to zlib and stdio.
+ **/
+#ifdef SHARK_IO_URING
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace async_io {
+  const size_t BLOCK_BYTES = (size_t)1 << 20;
+  const unsigned QUEUE_DEPTH = 16;
+}
+
+/**
+ * Minimal io_uring, set up with raw system calls: requests are
+ * submitted one at a time and their completions are waited for in
+ * any order.
+ **/
+class IoUring {
+public:
+  IoUring(const unsigned entries) : fd(-1) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) return;
+    sq_bytes = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_bytes = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    sq_ptr = mmap(nullptr, sq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    cq_ptr = mmap(nullptr, cq_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    sqes_bytes = p.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe *>(mmap(nullptr, sqes_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                            fd, IORING_OFF_SQES));
+    if (sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED || sqes == MAP_FAILED) {
+      unmap();
+      return;
+    }
+    char *const sq = static_cast<char *>(sq_ptr);
+    char *const cq = static_cast<char *>(cq_ptr);
+    sq_tail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+    sq_mask = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+    cq_head = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+    cq_mask = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+  }
+
+  ~IoUring() {
+    unmap();
+  }
+
+  bool ok() const {
+    return fd >= 0;
+  }
+
+  // Whether the kernel supports the operation (reads and writes need Linux 5.6)
+  bool supports(const uint8_t op) const {
+    vector<char> buf(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+    io_uring_probe *const probe = reinterpret_cast<io_uring_probe *>(buf.data());
+    if (fd < 0 || syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+      return false;
+    return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED) != 0;
+  }
+
+  bool read(const int file, char *buf, const size_t len, const uint64_t off, const uint64_t user_data) {
+    return submit(IORING_OP_READ, file, buf, len, off, user_data);
+  }
+
+  bool write(const int file, const char *buf, const size_t len, const uint64_t off, const uint64_t user_data) {
+    return submit(IORING_OP_WRITE, file, const_cast<char *>(buf), len, off, user_data);
+  }
+
+  // Waits for a completion: res is the result of the request (bytes, or -errno)
+  bool wait(uint64_t &user_data, int &res) {
+    unsigned head = *cq_head;
+    while (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+      if (syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR)
+        return false;
+    }
+    const io_uring_cqe &cqe = cqes[head & cq_mask];
+    user_data = cqe.user_data;
+    res = cqe.res;
+    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+private:
+  bool submit(const uint8_t op, const int file, char *buf, const size_t len, const uint64_t off,
+              const uint64_t user_data) {
+    const unsigned tail = *sq_tail;
+    io_uring_sqe &sqe = sqes[tail & sq_mask];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = op;
+    sqe.fd = file;
+    sqe.addr = reinterpret_cast<uint64_t>(buf);
+    sqe.len = len;
+    sqe.off = off;
+    sqe.user_data = user_data;
+    sq_array[tail & sq_mask] = tail & sq_mask;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    while (syscall(__NR_io_uring_enter, fd, 1, 0, 0, nullptr, 0) < 0) {
+      if (errno != EINTR && errno != EAGAIN) return false;
+    }
+    return true;
+  }
+
+  void unmap() {
+    if (fd < 0) return;
+    if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_bytes);
+    if (cq_ptr != MAP_FAILED) munmap(cq_ptr, cq_bytes);
+    if (sqes != MAP_FAILED) munmap(sqes, sqes_bytes);
+    close(fd);
+    fd = -1;
+  }
+
+  IoUring(const IoUring &) = delete;
+  const IoUring &operator=(const IoUring &) = delete;
+
+  int fd;
+  size_t sq_bytes, cq_bytes, sqes_bytes;
+  void *sq_ptr = MAP_FAILED;
+  void *cq_ptr = MAP_FAILED;
+  io_uring_sqe *sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+  unsigned *sq_tail, *sq_array, *cq_head, *cq_tail;
+  unsigned sq_mask, cq_mask;
+  io_uring_cqe *cqes;
+};
+
+/**
+ * Reads a regular file, plain or gzipped (also made of several gzip
+ * members, as gzread does, which ignores anything else following a
+ * member), with QUEUE_DEPTH blocks always requested ahead of the one
+ * being consumed.
+ **/
+class AsyncReader {
+public:
+  // nullptr if path is not a regular file or io_uring is not available
+  static AsyncReader *open(const string &path) {
+    // checked before opening, as opening a named pipe would wait for a writer
+    struct stat st;
+    if (path == "-" || stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return nullptr;
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+    AsyncReader *const reader = new AsyncReader(fd, st.st_size);
+    if (!reader->ring.ok() || !reader->ring.supports(IORING_OP_READ) || !reader->start()) {
+      delete reader;
+      return nullptr;
+    }
+    return reader;
+  }
+
+  ~AsyncReader() {
+    // the kernel may still write to the blocks in flight
+    uint64_t user_data;
+    int res;
+    for (; in_flight > 0 && ring.wait(user_data, res); --in_flight) { }
+    if (gzipped) inflateEnd(&zs);
+    close(fd);
+  }
+
+  // As gzread: the number of (decompressed) bytes read, 0 at the end, -1 on errors (also on a truncated member)
+  int read(char *out, const unsigned len) {
+    if (ahead >= 0 && len > 0) {
+      out[0] = static_cast<char>(ahead);
+      ahead = -1;
+      const int n = read(out + 1, len - 1);
+      return n < 0 ? -1 : n + 1;
+    }
+    if (!gzipped) {
+      unsigned n = 0;
+      while (n < len && next_input()) {
+        const unsigned m = min<size_t>(len - n, avail);
+        memcpy(out + n, input, m);
+        input += m;
+        avail -= m;
+        n += m;
+      }
+      return error ? -1 : n;
+    }
+    zs.next_out = reinterpret_cast<Bytef *>(out);
+    zs.avail_out = len;
+    while (zs.avail_out > 0 && !error && !ended) {
+      if (zs.avail_in == 0 && !next_compressed()) {
+        error = true; // truncated member
+        break;
+      }
+      const int ret = inflate(&zs, Z_NO_FLUSH);
+      if (ret == Z_STREAM_END) {
+        if (next_member()) inflateReset(&zs);
+        else ended = true;
+      } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        error = true;
+      }
+    }
+    return error ? -1 : len - zs.avail_out;
+  }
+
+  // The next byte, returned again by read (as gzgetc then gzungetc), -1 at the end or on errors
+  int peek() {
+    char c;
+    if (ahead < 0 && read(&c, 1) == 1) ahead = static_cast<unsigned char>(c);
+    return ahead;
+  }
+
+private:
+  AsyncReader(const int _fd, const uint64_t _size)
+    : ring(async_io::QUEUE_DEPTH), fd(_fd), size(_size),
+      blocks(async_io::QUEUE_DEPTH, vector<char>(async_io::BLOCK_BYTES)), lens(async_io::QUEUE_DEPTH, -1),
+      requested(0), consumed(0), in_flight(0), input(nullptr), avail(0), gzipped(false), ended(false), error(false), ahead(-1)
+  {
+    memset(&zs, 0, sizeof(zs));
+  }
+
+  // Requests the first blocks, and checks whether the file is gzipped
+  bool start() {
+    while (requested < async_io::QUEUE_DEPTH && request()) { }
+    if (error) return false;
+    if (!next_input()) return !error; // empty, or the first read failed
+    if (avail >= 2 && static_cast<unsigned char>(input[0]) == 0x1f && static_cast<unsigned char>(input[1]) == 0x8b) {
+      gzipped = true;
+      if (inflateInit2(&zs, 15 + 32) != Z_OK) return false;
+      zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input));
+      zs.avail_in = avail;
+    }
+    return true;
+  }
+
+  // Makes the next block the input of inflate
+  bool next_compressed() {
+    avail = 0;
+    if (!next_input()) return false;
+    zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input));
+    zs.avail_in = avail;
+    return true;
+  }
+
+  // Whether another gzip member follows the one just inflated
+  bool next_member() {
+    if (zs.avail_in == 0 && !next_compressed()) return false;
+    return zs.next_in[0] == 0x1f && (zs.avail_in < 2 || zs.next_in[1] == 0x8b);
+  }
+
+  // Requests the next block of the file, if any
+  bool request() {
+    const uint64_t off = requested * async_io::BLOCK_BYTES;
+    if (off >= size) return false;
+    const size_t slot = requested % async_io::QUEUE_DEPTH;
+    lens[slot] = -1;
+    if (!ring.read(fd, blocks[slot].data(), min<uint64_t>(async_io::BLOCK_BYTES, size - off), off, requested)) {
+      error = true;
+      return false;
+    }
+    ++requested;
+    ++in_flight;
+    return true;
+  }
+
+  /**
+   * Makes the next block the input, once it has been read, and requests
+   * the one QUEUE_DEPTH blocks ahead in its slot. Short reads are
+   * completed synchronously.
+   **/
+  bool next_input() {
+    if (avail > 0) return true;
+    if (input != nullptr) { // the current block is consumed
+      input = nullptr;
+      ++consumed;
+      request();
+    }
+    if (consumed == requested || error) return false;
+    const size_t slot = consumed % async_io::QUEUE_DEPTH;
+    while (lens[slot] < 0) {
+      uint64_t user_data;
+      int res;
+      if (!ring.wait(user_data, res) || res < 0) {
+        error = true;
+        return false;
+      }
+      --in_flight;
+      lens[user_data % async_io::QUEUE_DEPTH] = res;
+    }
+    const uint64_t off = consumed * async_io::BLOCK_BYTES;
+    const size_t len = min<uint64_t>(async_io::BLOCK_BYTES, size - off);
+    for (ssize_t n; static_cast<size_t>(lens[slot]) < len; lens[slot] += n) {
+      n = pread(fd, blocks[slot].data() + lens[slot], len - lens[slot], off + lens[slot]);
+      if (n <= 0) {
+        error = true;
+        return false;
+      }
+    }
+    input = blocks[slot].data();
+    avail = len;
+    return true;
+  }
+
+  AsyncReader(const AsyncReader &) = delete;
+  const AsyncReader &operator=(const AsyncReader &) = delete;
+
+  IoUring ring;
+  const int fd;
+  const uint64_t size;
+  vector<vector<char>> blocks; // block i is read in slot i % QUEUE_DEPTH
+  vector<ssize_t> lens;        // bytes read in each slot, -1 while in flight
+  uint64_t requested, consumed;
+  unsigned in_flight;
+  const char *input; // unconsumed bytes of the current block
+  size_t avail;
+  bool gzipped;
+  bool ended; // at the end of the gzip members
+  bool error;
+  int ahead; // byte peeked and not read yet, -1 if none
+  z_stream zs;
+};
+
+/**
+ * Writes a regular file in blocks, submitted as soon as they are full:
+ * up to QUEUE_DEPTH of them are written while the next one is filled
+ * (blocks are allocated when first filled). It is used through a FILE
+ * (fopencookie), so that the output is still written with stdio.
+ **/
+class AsyncWriter {
+public:
+  // nullptr if path exists and is not a regular file, or io_uring is not available
+  static FILE *open(const string &path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && !S_ISREG(st.st_mode)) return nullptr;
+    IoUring *const ring = new IoUring(async_io::QUEUE_DEPTH);
+    if (!ring->supports(IORING_OP_WRITE)) {
+      delete ring;
+      return nullptr;
+    }
+    const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+      delete ring;
+      return nullptr;
+    }
+    AsyncWriter *const writer = new AsyncWriter(fd, ring);
+    const cookie_io_functions_t functions = { nullptr, cookie_write, nullptr, cookie_close };
+    FILE *const file = fopencookie(writer, "w", functions);
+    if (file == nullptr) {
+      delete writer;
+      return nullptr;
+    }
+    setvbuf(file, nullptr, _IOFBF, (size_t)1 << 16);
+    return file;
+  }
+
+private:
+  AsyncWriter(const int _fd, IoUring *const _ring)
+    : ring(_ring), fd(_fd), blocks(async_io::QUEUE_DEPTH), offs(async_io::QUEUE_DEPTH), current(0),
+      in_flight(0), off(0), error(false)
+  { }
+
+  ~AsyncWriter() {
+    delete ring;
+    close(fd);
+  }
+
+  static ssize_t cookie_write(void *cookie, const char *buf, size_t len) {
+    AsyncWriter *const writer = static_cast<AsyncWriter *>(cookie);
+    for (size_t n = 0; n < len; ) {
+      vector<char> &b = writer->blocks[writer->current];
+      if (b.capacity() == 0) b.reserve(async_io::BLOCK_BYTES);
+      const size_t m = min(len - n, async_io::BLOCK_BYTES - b.size());
+      b.insert(b.end(), buf + n, buf + n + m);
+      n += m;
+      if (b.size() == async_io::BLOCK_BYTES && !writer->submit()) break;
+    }
+    return writer->error ? -1 : len;
+  }
+
+  static int cookie_close(void *cookie) {
+    AsyncWriter *const writer = static_cast<AsyncWriter *>(cookie);
+    if (!writer->blocks[writer->current].empty())
+      writer->submit();
+    while (writer->in_flight > 0 && writer->reap()) { }
+    const bool ok = !writer->error;
+    delete writer;
+    return ok ? 0 : EOF;
+  }
+
+  // Writes the current block, and moves to a free one
+  bool submit() {
+    vector<char> &b = blocks[current];
+    if (!ring->write(fd, b.data(), b.size(), off, current)) {
+      error = true;
+      return false;
+    }
+    offs[current] = off;
+    off += b.size();
+    ++in_flight;
+    current = (current + 1) % blocks.size();
+    // a block is free once written
+    while (!blocks[current].empty()) {
+      if (!reap()) return false;
+    }
+    return true;
+  }
+
+  // Waits for a block to be written; short writes are completed synchronously
+  bool reap() {
+    uint64_t user_data;
+    int res;
+    if (!ring->wait(user_data, res)) {
+      error = true;
+      return false;
+    }
+    --in_flight;
+    vector<char> &b = blocks[user_data];
+    for (ssize_t n; res >= 0 && static_cast<size_t>(res) < b.size(); res = n > 0 ? res + n : -1)
+      n = pwrite(fd, b.data() + res, b.size() - res, offs[user_data] + res);
+    if (res < 0) error = true;
+    b.clear();
+    return !error;
+  }
+
+  AsyncWriter(const AsyncWriter &) = delete;
+  const AsyncWriter &operator=(const AsyncWriter &) = delete;
+
+  IoUring *const ring;
+  const int fd;
+  vector<vector<char>> blocks;
+  vector<uint64_t> offs; // offset in the file of each block in flight
+  size_t current; // block being filled
+  size_t in_flight;
+  uint64_t off;
+  bool error;
+};
+
+#endif
+
+#endif
@@ -36,18 +36,19 @@ public:
   BloomfilterFiller(BF *_bf) : bf(_bf) {}
 
   void operator()(vector<uint64_t> *positions) {
-    {
-      std::lock_guard<std::mutex> lock(mtx);
-      for(const auto p : *positions) {
-        bf->add_at(p);
-      }
-    }
+    (*this)(*positions);
     delete positions;
   }
 
+  // Bits are set atomically, so threads fill the filter concurrently
+  void operator()(const vector<uint64_t> &positions) {
+    for(const auto p : positions) {
+      bf->add_at_concurrent(p);
+    }
+  }
+
 private:
   BF *const bf;
-  std::mutex mtx;
 
 };
 #endif
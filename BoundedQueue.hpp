@@ -0,0 +1,109 @@
+/**
+ * shark - Mapping-free filtering of useless RNA-Seq reads
+ * Copyright (C) 2020 Tamara Ceccato, Luca Denti, Yuri Pirola, Marco Previtali
+ *
+ * This file is part of shark.
+ *
+ * shark is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shark is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shark; see the file LICENSE. If not, see
+ * <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef BOUNDED_QUEUE_HPP
+#define BOUNDED_QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+/**
+ * Bounded lock-free multi-producer multi-consumer queue (D. Vyukov's
+ * array of cells tagged with sequence numbers). try_push and try_pop
+ * never block: they fail if the queue is full or empty.
+ **/
+template <typename T>
+class BoundedQueue {
+public:
+  explicit BoundedQueue(const size_t min_capacity)
+    : capacity(round_up(min_capacity)), mask(capacity - 1), cells(new cell_t[capacity]), pad0(), head(0), pad1(), tail(0)
+  {
+    for (size_t i = 0; i < capacity; ++i)
+      cells[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  bool try_push(const T &x) {
+    size_t pos = tail.load(std::memory_order_relaxed);
+    while (true) {
+      cell_t &cell = cells[pos & mask];
+      const size_t seq = cell.seq.load(std::memory_order_acquire);
+      const ptrdiff_t diff = static_cast<ptrdiff_t>(seq) - static_cast<ptrdiff_t>(pos);
+      if (diff == 0) {
+        if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          cell.value = x;
+          cell.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false; // full
+      } else {
+        pos = tail.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  bool try_pop(T &x) {
+    size_t pos = head.load(std::memory_order_relaxed);
+    while (true) {
+      cell_t &cell = cells[pos & mask];
+      const size_t seq = cell.seq.load(std::memory_order_acquire);
+      const ptrdiff_t diff = static_cast<ptrdiff_t>(seq) - static_cast<ptrdiff_t>(pos + 1);
+      if (diff == 0) {
+        if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          x = cell.value;
+          cell.seq.store(pos + capacity, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false; // empty
+      } else {
+        pos = head.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+private:
+  struct cell_t {
+    std::atomic<size_t> seq;
+    T value;
+  };
+
+  static size_t round_up(const size_t n) {
+    size_t c = 2;
+    while (c < n) c <<= 1;
+    return c;
+  }
+
+  BoundedQueue(const BoundedQueue &) = delete;
+  const BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+  const size_t capacity;
+  const size_t mask;
+  std::unique_ptr<cell_t[]> cells;
+  // head and tail on different cache lines (alignas would need C++17 for new)
+  char pad0[64];
+  std::atomic<size_t> head;
+  char pad1[64 - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> tail;
+};
+
+#endif
@@ -0,0 +1,150 @@
+/**
+ * shark - Mapping-free filtering of useless RNA-Seq reads
+ * Copyright (C) 2020 Tamara Ceccato, Luca Denti, Yuri Pirola, Marco Previtali
+ *
+ * This file is part of shark.
+ *
+ * shark is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shark is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shark; see the file LICENSE. If not, see
+ * <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef EXTERNAL_SORTER_HPP
+#define EXTERNAL_SORTER_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+using namespace std;
+
+/**
+ * Sorts a sequence of 64-bit values larger than memory: values are
+ * buffered, and each full buffer is sorted and spilled to an anonymous
+ * file (a run) in tmp_dir. The sorted sequence is then read back with
+ * next(), merging the runs. Runs are unlinked as soon as they are
+ * created, so they are removed even if shark is killed.
+ **/
+class ExternalSorter {
+public:
+  ExternalSorter(const string &_tmp_dir, const size_t _run_size)
+    : tmp_dir(_tmp_dir), run_size(max<size_t>(_run_size, 1024)), merging(false)
+  {
+    buffer.reserve(run_size);
+  }
+
+  ~ExternalSorter() {
+    for (auto &run : runs) fclose(run.file);
+  }
+
+  // Adds a block of values, a block is never split across runs
+  void add(const vector<uint64_t> &block) {
+    if (buffer.size() + block.size() > run_size) spill();
+    buffer.insert(buffer.end(), block.begin(), block.end());
+  }
+
+  size_t size() const { return total + buffer.size(); }
+
+  size_t nruns() const { return runs.size(); }
+
+  // Returns the next value of the sorted sequence, false when it is over
+  bool next(uint64_t &value) {
+    if (!merging) start_merge();
+    if (heap.empty()) return false;
+    const auto top = heap.top();
+    heap.pop();
+    value = top.first;
+    uint64_t v;
+    if (runs[top.second].read(v)) heap.push({ v, top.second });
+    return true;
+  }
+
+private:
+  struct run_t {
+    FILE *file;
+    vector<uint64_t> buf;
+    size_t pos, len;
+
+    bool read(uint64_t &v) {
+      if (pos == len) {
+        len = fread(buf.data(), sizeof(uint64_t), buf.size(), file);
+        pos = 0;
+        if (len == 0 && ferror(file)) {
+          cerr << "shark: cannot read a temporary file back." << endl
+               << "aborting..." << endl;
+          exit(EXIT_FAILURE);
+        }
+        if (len == 0) return false;
+      }
+      v = buf[pos++];
+      return true;
+    }
+  };
+
+  typedef pair<uint64_t, size_t> head_t;
+
+  const string tmp_dir;
+  const size_t run_size;
+  vector<uint64_t> buffer;
+  vector<run_t> runs;
+  size_t total = 0;
+  bool merging;
+  priority_queue<head_t, vector<head_t>, greater<head_t>> heap;
+
+  void spill() {
+    if (buffer.empty()) return;
+    sort(buffer.begin(), buffer.end());
+    string path = tmp_dir + "/shark_run_XXXXXX";
+    const int fd = mkstemp(&path[0]);
+    FILE *file = fd < 0 ? nullptr : fdopen(fd, "w+b");
+    if (file == nullptr) {
+      cerr << "shark: cannot create a temporary file in " << tmp_dir << "." << endl
+           << "aborting..." << endl;
+      exit(EXIT_FAILURE);
+    }
+    unlink(path.c_str());
+    if (fwrite(buffer.data(), sizeof(uint64_t), buffer.size(), file) != buffer.size() || fflush(file) != 0) {
+      cerr << "shark: cannot write a temporary file in " << tmp_dir << " (disk full?)." << endl
+           << "aborting..." << endl;
+      exit(EXIT_FAILURE);
+    }
+    total += buffer.size();
+    runs.push_back({ file, vector<uint64_t>(), 0, 0 });
+    buffer.clear();
+  }
+
+  void start_merge() {
+    merging = true;
+    spill();
+    vector<uint64_t>().swap(buffer);
+    // the read buffers take at most a run in total
+    const size_t buf_size = max<size_t>(run_size / max<size_t>(runs.size(), 1), 4096);
+    for (size_t i = 0; i < runs.size(); ++i) {
+      rewind(runs[i].file);
+      runs[i].buf.resize(buf_size);
+      uint64_t v;
+      if (runs[i].read(v)) heap.push({ v, i });
+    }
+  }
+};
+
+#endif
@@ -23,6 +23,7 @@
 #define FASTA_SPLITTER_HPP
 
 #include "kseq.h"
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <memory>
@@ -30,10 +31,21 @@
 
 using namespace std;
 
+/**
+ * Hands out batches of at most maxnum records. If chunk_len is not 0,
+ * a batch also stops at chunk_len bases, and longer records are split
+ * into chunks of chunk_len bases plus an overlap with the next one
+ * (k-1 bases, so that each k-mer is in exactly one chunk) handed out
+ * as separate records, so that long sequences are spread across
+ * threads. ids, if given, gets the name of each record only once.
+ **/
 class FastaSplitter {
 public:
-  FastaSplitter(kseq_t * const _seq, const int _maxnum, vector<string>* const _ids = nullptr)
-    : seq(_seq), maxnum(_maxnum), ids(_ids)
+  static const size_t CHUNK_LEN = 1 << 20;
+
+  FastaSplitter(kseq_t * const _seq, const int _maxnum, vector<string>* const _ids = nullptr,
+                const size_t _chunk_len = 0, const size_t _overlap = 0)
+    : seq(_seq), maxnum(_maxnum), ids(_ids), chunk_len(_chunk_len), overlap(_overlap), pending_pos(0)
   { }
 
   ~FastaSplitter() {
@@ -43,10 +55,26 @@ public:
     std::lock_guard<std::mutex> lock(mtx);
     vector<pair<string, string>>* const fasta = new vector<pair<string, string>>();
     fasta->reserve(maxnum);
-    int seq_len;
-    while(fasta->size() < maxnum && (seq_len = kseq_read(seq)) >= 0) {
-      if (ids != nullptr) ids->push_back(seq->name.s);
-      fasta->emplace_back(seq->name.s, seq->seq.s);
+    size_t bases = 0;
+    while(fasta->size() < maxnum && (chunk_len == 0 || bases < chunk_len)) {
+      if (pending.second.empty()) {
+        if (kseq_read(seq) < 0) break;
+        if (ids != nullptr) ids->push_back(seq->name.s);
+        if (chunk_len == 0 || seq->seq.l <= chunk_len + overlap) {
+          fasta->emplace_back(seq->name.s, seq->seq.s);
+          bases += seq->seq.l;
+          continue;
+        }
+        pending = make_pair(string(seq->name.s), string(seq->seq.s, seq->seq.l));
+        pending_pos = 0;
+      }
+      // next chunk of the long record
+      const size_t len = min(chunk_len + overlap, pending.second.size() - pending_pos);
+      fasta->emplace_back(pending.first, pending.second.substr(pending_pos, len));
+      bases += len;
+      pending_pos += chunk_len;
+      if (pending_pos + overlap >= pending.second.size())
+        pair<string, string>().swap(pending);
     }
     if (!fasta->empty()) return fasta;
     delete fasta;
@@ -57,6 +85,10 @@ private:
   kseq_t * const seq;
   const size_t maxnum;
   vector<string>* const ids;
+  const size_t chunk_len;
+  const size_t overlap;
+  pair<string, string> pending; // long record being split
+  size_t pending_pos;
   std::mutex mtx;
 
 };
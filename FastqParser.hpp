@@ -0,0 +1,216 @@
+/**
+ * shark - Mapping-free filtering of useless RNA-Seq reads
+ * Copyright (C) 2020 Tamara Ceccato, Luca Denti, Yuri Pirola, Marco Previtali
+ *
+ * This file is part of shark.
+ *
+ * shark is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shark is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shark; see the file LICENSE. If not, see
+ * <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef FASTQ_PARSER_HPP
+#define FASTQ_PARSER_HPP
+
+#include <cctype>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+using namespace std;
+
+/**
+ * FASTQ (or FASTA) parser reading (and decompressing) its input in large blocks:
+ * lines are found with memchr, which scans many bytes at a time
+ * (vectorised in glibc), and records are returned as views into the
+ * block, so that they are copied only once, into the batch. Records
+ * are parsed as kseq does: the name stops at the first blank, lines
+ * may end with \r, and sequences and qualities may span several lines
+ * (such records are gathered in a buffer of the parser). Parsing stops
+ * at the first malformed record, and at the first read error (then
+ * failed() is true).
+ **/
+class FastqParser {
+public:
+  // Valid until the next call to next
+  struct record_t {
+    const char *name;
+    size_t name_l;
+    const char *seq;
+    size_t l;
+    const char *qual;
+    size_t qual_l; // l, or 0 for a FASTA record
+  };
+
+  // Reads up to len bytes into buf, as gzread does, but fails (-1) on a
+  // truncated input
+  typedef function<int(char *buf, unsigned len)> reader_t;
+
+  static const size_t BLOCK_SIZE = (size_t)1 << 22;
+
+  FastqParser(gzFile const in)
+    : FastqParser([in](char *buf, const unsigned len) { return gz_read(in, buf, len); }) {}
+
+  FastqParser(const reader_t &_read) : read(_read), buf(BLOCK_SIZE), begin(0), end(0), eof(false), error(false) {}
+
+  bool next(record_t &r) {
+    while (!error) {
+      const int res = parse(r);
+      if (res != NEED_MORE)
+        return res == OK;
+      if (!fill())
+        return false;
+    }
+    return false;
+  }
+
+  bool failed() const {
+    return error;
+  }
+
+  // gzread, but -1 on a truncated input
+  static int gz_read(gzFile const in, char *buf, const unsigned len) {
+    const int n = gzread(in, buf, len);
+    int err = Z_OK;
+    if (n == 0) gzerror(in, &err); // gzread hides an unexpected end of file
+    return err == Z_OK ? n : -1;
+  }
+
+private:
+  enum { OK, NEED_MORE, END };
+
+  /**
+   * Parses the record at begin. If it is incomplete, NEED_MORE is
+   * returned and begin is left untouched, so that it is parsed again
+   * once the block has been refilled.
+   **/
+  int parse(record_t &r) {
+    size_t p = begin;
+    size_t b, e;
+    // header
+    do {
+      if (!line(p, b, e)) return eof ? END : NEED_MORE;
+    } while (e == b || (buf[b] != '@' && buf[b] != '>'));
+    r.name = buf.data() + b + 1;
+    r.name_l = 0;
+    while (b + 1 + r.name_l < e && !isspace(r.name[r.name_l])) ++r.name_l;
+
+    // sequence, up to the + line (or to the next record, in FASTA)
+    size_t seq_b = 0, seq_e = 0;
+    int seq_lines = 0;
+    bool plus = false;
+    for (size_t q = p; ; ) {
+      if (!line(q, b, e)) {
+        if (!eof) return NEED_MORE;
+        break;
+      }
+      if (e > b && (buf[b] == '+' || buf[b] == '@' || buf[b] == '>')) {
+        plus = buf[b] == '+';
+        if (plus) p = q;
+        break;
+      }
+      p = q;
+      if (e == b) continue;
+      if (seq_lines++ == 0) {
+        seq_b = b;
+        seq_e = e;
+      } else {
+        if (seq_lines == 2) seq.assign(buf.data() + seq_b, seq_e - seq_b);
+        seq.append(buf.data() + b, e - b);
+      }
+    }
+    r.seq = seq_lines > 1 ? seq.data() : buf.data() + seq_b;
+    r.l = seq_lines > 1 ? seq.size() : seq_e - seq_b;
+    r.qual = nullptr;
+    r.qual_l = 0;
+    if (!plus) {
+      begin = p;
+      return OK;
+    }
+
+    // qualities, until they are as long as the sequence
+    size_t qual_b = 0, qual_e = 0;
+    int qual_lines = 0;
+    size_t qual_l = 0;
+    while (qual_l < r.l) {
+      if (!line(p, b, e)) return eof ? END : NEED_MORE;
+      if (qual_lines++ == 0) {
+        qual_b = b;
+        qual_e = e;
+      } else {
+        if (qual_lines == 2) qual.assign(buf.data() + qual_b, qual_e - qual_b);
+        qual.append(buf.data() + b, e - b);
+      }
+      qual_l += e - b;
+    }
+    if (qual_l != r.l) return END;
+    r.qual = qual_lines > 1 ? qual.data() : buf.data() + qual_b;
+    r.qual_l = qual_l;
+    begin = p;
+    return OK;
+  }
+
+  /**
+   * Finds the line starting at p: [b, e) without the line terminator,
+   * and p is moved to the next line. At the end of the input, the last
+   * line needs no terminator. Returns false if the line is incomplete
+   * (or there are no more lines).
+   **/
+  bool line(size_t &p, size_t &b, size_t &e) const {
+    if (p >= end) return false;
+    const char *const nl = static_cast<const char *>(memchr(buf.data() + p, '\n', end - p));
+    b = p;
+    if (nl == nullptr) {
+      if (!eof) return false;
+      e = p = end;
+    } else {
+      e = nl - buf.data();
+      p = e + 1;
+    }
+    if (e > b && buf[e - 1] == '\r') --e;
+    return true;
+  }
+
+  // Moves what is left of the block to its front and reads the next bytes
+  bool fill() {
+    if (eof) return false;
+    if (begin == 0 && end == buf.size())
+      buf.resize(buf.size() * 2); // a record longer than the block
+    memmove(buf.data(), buf.data() + begin, end - begin);
+    end -= begin;
+    begin = 0;
+    const int n = read(buf.data() + end, buf.size() - end);
+    if (n < 0)
+      error = true;
+    if (n <= 0)
+      eof = true;
+    else
+      end += n;
+    return true;
+  }
+
+  FastqParser() = delete;
+  FastqParser(const FastqParser &) = delete;
+  const FastqParser &operator=(const FastqParser &) = delete;
+
+  const reader_t read;
+  vector<char> buf;
+  size_t begin, end; // unparsed bytes of buf
+  bool eof;
+  bool error;
+  string seq, qual; // records spanning several lines
+};
+
+#endif
@@ -23,7 +23,7 @@
 #define FASTQ_SPLITTER_HPP
 
 #include "common.hpp"
-#include "kseq.h"
+#include "FastqParser.hpp"
 #include <string>
 #include <vector>
 #include <memory>
@@ -36,80 +36,67 @@ public:
 
   typedef vector<elem_t> output_t;
 
-  FastqSplitter(kseq_t * const _seq1, kseq_t * const _seq2, const int _maxnum, const char _min_quality, const bool _full_mode)
-    : seq1(_seq1), seq2(_seq2), maxnum(_maxnum), min_quality(_min_quality), full_mode(_full_mode), empty_el({})
+  FastqSplitter(FastqParser * const _fq1, FastqParser * const _fq2, const int _maxnum, const char _min_quality,
+                const bool _full_mode)
+    : fq1(_fq1), fq2(_fq2), maxnum(_maxnum), min_quality(_min_quality), full_mode(_full_mode)
   {
   }
 
   ~FastqSplitter() {
   }
 
+  /**
+   * Reads a batch of reads. The sequence to analyze (the two mates
+   * joined by an N, in paired-end mode) is copied from the block of the
+   * parser and masked in the same pass: bases whose quality is below
+   * min_quality, as well as the N joining the mates, are lowered by
+   * 64.
+   **/
   void operator()(output_t& fastq) {
     std::lock_guard<std::mutex> lock(mtx);
     fastq.reserve(maxnum);
-    int seq_len1, seq_len2;
-    if (min_quality == 0) {
-      if (seq2 == nullptr) {
-        while (fastq.size() < maxnum && (seq_len1 = kseq_read(seq1)) >= 0) {
-          fastq.push_back({
-            seq1->seq.s,
-            { { seq1->name.s, full_mode ? seq1->seq.s : "", full_mode ? seq1->qual.s : "" },
-              empty_el }
-          });
-        }
-      } else {
-        while (fastq.size() < maxnum && (seq_len1 = kseq_read(seq1)) >= 0 && (seq_len2 = kseq_read(seq2)) >= 0) {
-          fastq.push_back({
-            string(seq1->seq.s) + "N" + string(seq2->seq.s),
-            { { seq1->name.s, full_mode ? seq1->seq.s : "", full_mode ? seq1->qual.s : "" },
-              { seq2->name.s, full_mode ? seq2->seq.s : "", full_mode ? seq2->qual.s : "" } }
-          });
-        }
-      }
-    } else {
-      const char mq = min_quality + 33;
-      if (seq2 == nullptr) {
-        while (fastq.size() < maxnum && (seq_len1 = kseq_read(seq1)) >= 0) {
-          fastq.push_back({
-            mask_seq(seq1->seq.s, seq1->qual.s, seq1->qual.l, mq),
-            { { seq1->name.s, full_mode ? seq1->seq.s : "", full_mode ? seq1->qual.s : "" },
-              empty_el }
-          });
-        }
-      } else {
-        while (fastq.size() < maxnum && (seq_len1 = kseq_read(seq1)) >= 0 && (seq_len2 = kseq_read(seq2)) >= 0) {
-          fastq.push_back({
-            mask_seq(
-              string(seq1->seq.s) + "N" + string(seq2->seq.s),
-              string(seq1->qual.s) + "\33" + string(seq2->qual.s),
-              mq
-            ),
-            { { seq1->name.s, full_mode ? seq1->seq.s : "", full_mode ? seq1->qual.s : "" },
-              { seq2->name.s, full_mode ? seq2->seq.s : "", full_mode ? seq2->qual.s : "" } }
-          });
-        }
+    const char mq = min_quality == 0 ? 0 : min_quality + 33;
+    FastqParser::record_t r1 = {}, r2 = {};
+    while (fastq.size() < maxnum && fq1->next(r1) && (fq2 == nullptr || fq2->next(r2))) {
+      fastq.emplace_back();
+      elem_t &read = fastq.back();
+      read.first.reserve(r1.l + (fq2 == nullptr ? 0 : r2.l + 1));
+      append_masked(read.first, r1, mq);
+      set_sharseq(read.second.first, r1);
+      if (fq2 != nullptr) {
+        read.first.push_back(mq == 0 ? 'N' : 'N' - 64);
+        append_masked(read.first, r2, mq);
+        set_sharseq(read.second.second, r2);
       }
     }
   }
 
 private:
-  kseq_t * const seq1;
-  kseq_t * const seq2;
+  FastqParser * const fq1;
+  FastqParser * const fq2;
   const size_t maxnum;
   const char min_quality;
   const bool full_mode;
-  const sharseq_t empty_el;
   std::mutex mtx;
 
-  static string mask_seq(string seq, const char* const qual, const size_t l, const char min_quality) {
-    for (size_t i = 0; i < l; ++i) {
-      if (qual[i] < min_quality) seq[i] = seq[i] - 64;
+  static void append_masked(string &seq, const FastqParser::record_t &r, const char mq) {
+    if (mq == 0 || r.qual_l != r.l) {
+      seq.append(r.seq, r.l);
+      return;
     }
-    return seq;
+    const size_t from = seq.size();
+    seq.resize(from + r.l);
+    char *const out = &seq[from];
+    for (size_t i = 0; i < r.l; ++i)
+      out[i] = r.seq[i] - (r.qual[i] < mq ? 64 : 0);
   }
 
-  static string mask_seq(string seq, const string& qual, const char min_quality) {
-    return mask_seq(seq, qual.c_str(), qual.length(), min_quality);
+  void set_sharseq(sharseq_t &s, const FastqParser::record_t &r) const {
+    s.id.assign(r.name, r.name_l);
+    if (full_mode) {
+      s.seq.assign(r.seq, r.l);
+      s.qual.assign(r.qual == nullptr ? "" : r.qual, r.qual_l);
+    }
   }
 };
 
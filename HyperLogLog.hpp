@@ -0,0 +1,77 @@
+/**
+ * shark - Mapping-free filtering of useless RNA-Seq reads
+ * Copyright (C) 2020 Tamara Ceccato, Luca Denti, Yuri Pirola, Marco Previtali
+ *
+ * This file is part of shark.
+ *
+ * shark is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shark is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shark; see the file LICENSE. If not, see
+ * <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef HYPERLOGLOG_HPP
+#define HYPERLOGLOG_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+/**
+ * HyperLogLog sketch estimating the number of distinct elements from
+ * their (64-bit, uniformly distributed) hashes. The first p bits of a
+ * hash select a register, the register keeps the maximum position of
+ * the leftmost 1 in the remaining bits. Standard error is 1.04/sqrt(2^p)
+ * (~0.8% with the default p=14, using 16KB).
+ **/
+class HyperLogLog {
+public:
+  HyperLogLog(const uint8_t _p = 14) : p(_p), m((size_t)1 << _p), registers(m, 0) {}
+
+  void add(const uint64_t hash) {
+    const size_t idx = hash >> (64 - p);
+    // the sentinel bit bounds the rank to 64-p+1 when the other bits are 0
+    const uint64_t w = (hash << p) | ((uint64_t)1 << (p - 1));
+    const uint8_t rank = __builtin_clzll(w) + 1;
+    if (rank > registers[idx]) registers[idx] = rank;
+  }
+
+  void merge(const HyperLogLog &o) {
+    for (size_t i = 0; i < m; ++i)
+      registers[i] = max(registers[i], o.registers[i]);
+  }
+
+  double estimate() const {
+    const double alpha = 0.7213 / (1.0 + 1.079 / m);
+    double sum = 0.0;
+    size_t zeros = 0;
+    for (const auto r : registers) {
+      sum += ldexp(1.0, -r);
+      zeros += r == 0 ? 1 : 0;
+    }
+    const double e = alpha * m * m / sum;
+    // small range correction (linear counting)
+    if (e <= 2.5 * m && zeros > 0)
+      return m * log((double)m / zeros);
+    return e;
+  }
+
+private:
+  const uint8_t p;
+  const size_t m;
+  vector<uint8_t> registers;
+};
+
+#endif
@@ -0,0 +1,167 @@
+/**
+ * shark - Mapping-free filtering of useless RNA-Seq reads
+ * Copyright (C) 2020 Tamara Ceccato, Luca Denti, Yuri Pirola, Marco Previtali
+ *
+ * This file is part of shark.
+ *
+ * shark is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shark is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shark; see the file LICENSE. If not, see
+ * <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef INTERLEAVED_BIT_VECTOR_HPP
+#define INTERLEAVED_BIT_VECTOR_HPP
+
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "memory_utils.hpp"
+
+using namespace std;
+
+/**
+ * Bit vector with its rank support interleaved: bits are stored in
+ * blocks of a cache line (64 bytes), each made of the number of ones
+ * in the previous blocks followed by BLOCK_BITS bits, so that both the
+ * value and the rank of a bit are read from the same line. Counters
+ * are computed by init_rank, once the bits are set (1.14 bits per
+ * bit, instead of the 1.25 of a separate rank support).
+ **/
+class InterleavedBitVector {
+public:
+  static const size_t BLOCK_BITS = 448; // 7 words
+  static const size_t BLOCK_WORDS = 8;  // counter + bits
+
+  InterleavedBitVector(const size_t size) :
+    _size(size),
+    // one more block, whose counter is the number of ones, for rank(size);
+    // 7 more words to align the blocks to a cache line
+    _words((size / BLOCK_BITS + 1) * BLOCK_WORDS + 7, 0),
+    _blocks(reinterpret_cast<uint64_t *>((reinterpret_cast<uintptr_t>(_words.data()) + 63) & ~(uintptr_t)63))
+  {}
+
+  size_t size() const {
+    return _size;
+  }
+
+  // Bytes taken by the bits and the counters
+  size_t bytes() const {
+    return _words.size() * sizeof(uint64_t);
+  }
+
+  bool operator[](const size_t i) const {
+    return (_word(i) >> (i & 63)) & 1;
+  }
+
+  void set(const size_t i) {
+    _word(i) |= static_cast<uint64_t>(1) << (i & 63);
+  }
+
+  // Same as set, but safe when called concurrently
+  void set_concurrent(const size_t i) {
+    __atomic_fetch_or(&_word(i), static_cast<uint64_t>(1) << (i & 63), __ATOMIC_RELAXED);
+  }
+
+  // Number of words (bits 64w..64w+63) of the plain layout
+  size_t words() const {
+    return (_size + 63) / 64;
+  }
+
+  uint64_t word(const size_t w) const {
+    return _blocks[w / 7 * BLOCK_WORDS + 1 + w % 7];
+  }
+
+  void set_word(const size_t w, const uint64_t bits) {
+    _blocks[w / 7 * BLOCK_WORDS + 1 + w % 7] = bits;
+  }
+
+  void init_rank() {
+    uint64_t ones = 0;
+    for (size_t b = 0; b <= _size / BLOCK_BITS; ++b) {
+      uint64_t *const block = _blocks + b * BLOCK_WORDS;
+      block[0] = ones;
+      for (size_t w = 1; w < BLOCK_WORDS; ++w)
+        ones += __builtin_popcountll(block[w]);
+    }
+  }
+
+  // Number of ones in [0, i) (after init_rank)
+  uint64_t rank(const size_t i) const {
+    const uint64_t *const block = _blocks + i / BLOCK_BITS * BLOCK_WORDS;
+    const size_t off = i % BLOCK_BITS;
+    uint64_t r = block[0];
+    for (size_t w = 1; w <= off / 64; ++w)
+      r += __builtin_popcountll(block[w]);
+    if (off & 63)
+      r += __builtin_popcountll(block[1 + off / 64] & ((static_cast<uint64_t>(1) << (off & 63)) - 1));
+    return r;
+  }
+
+  // Number of ones in [0, i] if the i-th bit is set, 0 otherwise (after init_rank)
+  uint64_t rank_if_set(const size_t i) const {
+    const uint64_t *const block = _blocks + i / BLOCK_BITS * BLOCK_WORDS;
+    const size_t off = i % BLOCK_BITS;
+    const uint64_t bits = block[1 + off / 64];
+    if (!((bits >> (off & 63)) & 1))
+      return 0;
+    uint64_t r = block[0] + __builtin_popcountll(bits & (~static_cast<uint64_t>(0) >> (63 - (off & 63))));
+    for (size_t w = 1; w <= off / 64; ++w)
+      r += __builtin_popcountll(block[w]);
+    return r;
+  }
+
+  /**
+   * The bits are written (and read back) in the format of
+   * sdsl::bit_vector::serialize: the size in bits, then the words.
+   **/
+  bool serialize(ostream &out) const {
+    const uint64_t size = _size;
+    out.write(reinterpret_cast<const char *>(&size), sizeof(size));
+    for (size_t w = 0; w < words(); ++w) {
+      const uint64_t bits = word(w);
+      out.write(reinterpret_cast<const char *>(&bits), sizeof(bits));
+    }
+    return out.good();
+  }
+
+  // Reads the bits of a vector of the same size, and inits the rank
+  bool load(istream &in) {
+    uint64_t size = 0;
+    if (!in.read(reinterpret_cast<char *>(&size), sizeof(size)) || size != _size)
+      return false;
+    for (size_t w = 0; w < words(); ++w) {
+      uint64_t bits;
+      if (!in.read(reinterpret_cast<char *>(&bits), sizeof(bits)))
+        return false;
+      set_word(w, bits);
+    }
+    init_rank();
+    return true;
+  }
+
+private:
+  uint64_t &_word(const size_t i) const {
+    return _blocks[i / BLOCK_BITS * BLOCK_WORDS + 1 + i % BLOCK_BITS / 64];
+  }
+
+  InterleavedBitVector() = delete;
+  InterleavedBitVector(const InterleavedBitVector &) = delete;
+  const InterleavedBitVector &operator=(const InterleavedBitVector &) = delete;
+
+  const size_t _size;
+  vector<uint64_t, policy_allocator<uint64_t>> _words;
+  uint64_t *const _blocks; // first block of _words aligned to a cache line
+};
+
+#endif
@@ -0,0 +1,179 @@
+/**
+ * shark - Mapping-free filtering of useless RNA-Seq reads
+ * Copyright (C) 2020 Tamara Ceccato, Luca Denti, Yuri Pirola, Marco Previtali
+ *
+ * This file is part of shark.
+ *
+ * shark is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shark is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shark; see the file LICENSE. If not, see
+ * <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef MAPPED_FASTA_HPP
+#define MAPPED_FASTA_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "kmer_utils.hpp"
+
+using namespace std;
+
+/**
+ * Uncompressed FASTA file mapped in memory: records are located once
+ * (offsets of their name and sequence in the mapping) and k-merised
+ * directly from the mapped bytes, skipping the line breaks, with no
+ * copy of the sequences. Threads can k-merise different parts of the
+ * file concurrently.
+ **/
+class MappedFasta {
+public:
+  struct record_t {
+    size_t name_begin, name_end;
+    size_t seq_begin, seq_end; // bytes of the sequence, line breaks included
+  };
+
+  // Part of the sequence of a record: the k-mers ending in [from, to)
+  struct unit_t {
+    size_t record;
+    size_t from, to;
+  };
+
+  MappedFasta() : data(nullptr), size(0) {}
+
+  ~MappedFasta() {
+    if (data != nullptr)
+      munmap(const_cast<char *>(data), size);
+  }
+
+  /**
+   * Maps path and locates its records. Fails (and the caller should
+   * read the file with kseq) if path cannot be mapped or is gzipped.
+   **/
+  bool open(const string &path) {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < 2) {
+      close(fd);
+      return false;
+    }
+    void *const p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+      return false;
+    data = static_cast<const char *>(p);
+    size = st.st_size;
+    if (data[0] != '>') { // gzipped, or not FASTA
+      munmap(p, size);
+      data = nullptr;
+      return false;
+    }
+    madvise(p, size, MADV_WILLNEED);
+    locate_records();
+    return true;
+  }
+
+  const vector<record_t> &records() const {
+    return recs;
+  }
+
+  string name(const record_t &r) const {
+    return string(data + r.name_begin, r.name_end - r.name_begin);
+  }
+
+  /**
+   * Splits the records in units of about unit_len bytes of sequence,
+   * so that long records are spread across threads.
+   **/
+  vector<unit_t> units(const size_t unit_len) const {
+    vector<unit_t> u;
+    for (size_t i = 0; i < recs.size(); ++i)
+      for (size_t from = recs[i].seq_begin; from < recs[i].seq_end; from += unit_len)
+        u.push_back({ i, from, min(from + unit_len, recs[i].seq_end) });
+    return u;
+  }
+
+  /**
+   * Calls f on the canonical k-mers of the sequence of r whose last
+   * base is in the bytes [from, to): the k-1 bases before from are
+   * read again, so that adjacent units share no k-mer.
+   **/
+  template <typename F>
+  void for_each_kmer(const record_t &r, const size_t from, const size_t to, const uint8_t k, F f) const {
+    size_t p = from;
+    for (uint8_t bases = 0; p > r.seq_begin && bases < k - 1; ) {
+      --p;
+      if (data[p] != '\n' && data[p] != '\r')
+        ++bases;
+    }
+    uint64_t kmer = 0, rckmer = 0;
+    uint8_t valid = 0;
+    for (; p < to; ++p) {
+      const unsigned char c = data[p];
+      if (c == '\n' || c == '\r')
+        continue;
+      uint8_t new_char = c < 128 ? to_int[c] : 0;
+      if (new_char == 0) { // Found a char different from A, C, G, T
+        valid = 0;
+        continue;
+      }
+      --new_char; // A is 1 but it should be 0
+      kmer = lsappend(kmer, new_char, k);
+      rckmer = rsprepend(rckmer, reverse_char(new_char), k);
+      if (valid < k)
+        ++valid;
+      if (valid == k && p >= from)
+        f(min(kmer, rckmer));
+    }
+  }
+
+private:
+  void locate_records() {
+    size_t p = 0;
+    while (p < size) {
+      // p is at a '>'
+      record_t r;
+      r.name_begin = p + 1;
+      r.name_end = r.name_begin;
+      while (r.name_end < size && data[r.name_end] != '\n' && data[r.name_end] != ' ' &&
+             data[r.name_end] != '\t' && data[r.name_end] != '\r')
+        ++r.name_end;
+      const char *nl = static_cast<const char *>(memchr(data + r.name_end, '\n', size - r.name_end));
+      r.seq_begin = nl == nullptr ? size : nl - data + 1;
+      r.seq_end = r.seq_begin;
+      // the sequence ends at the next line starting with '>'
+      while (r.seq_end < size && data[r.seq_end] != '>') {
+        const char *eol = static_cast<const char *>(memchr(data + r.seq_end, '\n', size - r.seq_end));
+        r.seq_end = eol == nullptr ? size : eol - data + 1;
+      }
+      recs.push_back(r);
+      p = r.seq_end;
+    }
+  }
+
+  const char *data;
+  size_t size;
+  vector<record_t> recs;
+};
+
+#endif
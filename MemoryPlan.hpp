@@ -0,0 +1,148 @@
+/**
+ * shark - Mapping-free filtering of useless RNA-Seq reads
+ * Copyright (C) 2020 Tamara Ceccato, Luca Denti, Yuri Pirola, Marco Previtali
+ *
+ * This file is part of shark.
+ *
+ * shark is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shark is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shark; see the file LICENSE. If not, see
+ * <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef MEMORY_PLAN_HPP
+#define MEMORY_PLAN_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+using namespace std;
+
+/**
+ * Memory layout of a run planned against a budget (--max-memory): the
+ * size of the Bloom filter, the number of reads per batch and the
+ * number of batches analyzed at the same time.
+ **/
+struct memory_plan_t {
+  uint64_t bf_size;      // bits
+  size_t batch_size;     // reads per batch
+  int max_batches;       // batches in flight, i.e. analysis threads
+  size_t run_size;       // (k-mer, id) pairs per sorted run, if the index is built out of core
+  bool offsets;          // the sets of ids are delimited by an offset array (BF::build_offsets)
+  uint64_t index_bytes;  // peak of the index construction
+  uint64_t reads_bytes;  // batches in flight
+  uint64_t read_cache_bytes; // cache of the verdicts of the analysis
+  uint64_t io_bytes;     // blocks in flight of the asynchronous reads and writes
+};
+
+namespace memory_plan {
+  const size_t BATCH_SIZE = 50000;
+  const size_t MIN_BATCH_SIZE = 1000;
+  // Bytes taken by a read (150bp: header, sequence and qualities, plus
+  // the copies in the batch and in the associations)
+  const uint64_t READ_BYTES = 1024;
+  // Worst false positive rate accepted when shrinking an estimated filter
+  const double MAX_FPR = 0.05;
+  // Pairs per sorted run of the out-of-core construction (256MB)
+  const size_t RUN_SIZE = (size_t)1 << 25;
+  // Bits taken by a bit of the filter: a 64-bit counter every 448 bits
+  const double BF_BITS_RATIO = 512.0 / 448;
+}
+
+// Bits of a filter with a single hash function: fpr = 1 - exp(-n/m)
+uint64_t bf_bits_for(const double kmers, const double fpr) {
+  uint64_t bits = static_cast<uint64_t>(ceil(-kmers / log1p(-fpr)));
+  bits = max(bits, (uint64_t)1 << 20);
+  return (bits + 63) / 64 * 64;
+}
+
+/**
+ * Peak memory of the index, reached in switch_mode(2) when the sets of
+ * ids of the k-mers (8 bytes each, more if a k-mer is shared by more
+ * than 3 genes) coexist with the filter and its interleaved rank
+ * counters (BF_BITS_RATIO bits per bit) and with the final arrays:
+ * 16-bit ids, the bit vector delimiting them and its select support
+ * (~1.5 bits per id). We assume one id per k-mer, so this is a lower
+ * bound for references with many shared k-mers. Out of core
+ * (run_size > 0), the sets are replaced by a buffer of run_size pairs,
+ * also used to merge the runs. The offset array, if any, takes
+ * log2(ids) bits per k-mer more.
+ **/
+uint64_t index_peak_bytes(const uint64_t bf_bits, const double kmers, const size_t run_size = 0,
+                          const bool offsets = false) {
+  const double sets = run_size > 0 ? run_size * 8.0 : kmers * 8;
+  const double offsets_bytes = offsets ? kmers * (log2(kmers + 1) + 1) / 8 : 0;
+  return static_cast<uint64_t>(bf_bits / 8.0 * memory_plan::BF_BITS_RATIO + sets + kmers * (2 + 1.5 / 8) + offsets_bytes);
+}
+
+uint64_t batch_bytes(const size_t batch_size, const bool paired) {
+  return batch_size * memory_plan::READ_BYTES * (paired ? 2 : 1);
+}
+
+inline string gigabytes(const uint64_t bytes) {
+  char buf[32];
+  if (bytes < ((uint64_t)1 << 30))
+    snprintf(buf, sizeof(buf), "%.1fMB", bytes / (double)((uint64_t)1 << 20));
+  else
+    snprintf(buf, sizeof(buf), "%.2fGB", bytes / (double)((uint64_t)1 << 30));
+  return buf;
+}
+
+/**
+ * Plans the memory of a run with threads analysis threads (0 if no
+ * reads are analyzed) within budget bytes. If plan.run_size is not 0,
+ * the index is built out of core and the size of its runs is planned
+ * as well, and plan.offsets tells whether the index has an offset
+ * array. The filter keeps bf_bits bits if possible; otherwise batches
+ * are shrunk first (down to MIN_BATCH_SIZE reads), then their number,
+ * and finally, unless its size was given explicitly, the filter (up to
+ * a false positive rate of MAX_FPR). Returns false, setting error, if
+ * even the smallest layout does not fit.
+ **/
+bool plan_memory(const uint64_t budget, const double kmers, const uint64_t bf_bits, const bool bf_fixed,
+                 const int threads, const bool paired, memory_plan_t &plan, string &error) {
+  const uint64_t min_reads = threads > 0 ? batch_bytes(memory_plan::MIN_BATCH_SIZE, paired) : 0;
+  // out of core, runs take at most an eighth of the budget
+  if (plan.run_size > 0)
+    plan.run_size = max<size_t>(min<size_t>(memory_plan::RUN_SIZE, budget / 8 / 8), 1 << 16);
+  plan.bf_size = bf_bits;
+  plan.index_bytes = index_peak_bytes(bf_bits, kmers, plan.run_size, plan.offsets);
+  if (plan.index_bytes + min_reads > budget && !bf_fixed) {
+    const uint64_t min_bits = bf_bits_for(kmers, memory_plan::MAX_FPR);
+    const uint64_t ids_bytes = index_peak_bytes(0, kmers, plan.run_size, plan.offsets);
+    if (budget > ids_bytes + min_reads)
+      plan.bf_size = min(bf_bits, static_cast<uint64_t>((budget - ids_bytes - min_reads) * 8 / memory_plan::BF_BITS_RATIO) / 64 * 64);
+    plan.bf_size = max(plan.bf_size, min_bits);
+    plan.index_bytes = index_peak_bytes(plan.bf_size, kmers, plan.run_size, plan.offsets);
+  }
+  if (plan.index_bytes + min_reads > budget) {
+    error = "about " + gigabytes(plan.index_bytes + min_reads) + " are needed (index " + gigabytes(plan.index_bytes)
+      + ", reads " + gigabytes(min_reads) + ") but the memory budget is " + gigabytes(budget);
+    return false;
+  }
+
+  const uint64_t available = budget - plan.index_bytes;
+  plan.batch_size = memory_plan::BATCH_SIZE;
+  plan.max_batches = threads;
+  if (threads > 0 && batch_bytes(plan.batch_size, paired) * threads > available) {
+    plan.batch_size = max(memory_plan::MIN_BATCH_SIZE, available / threads / batch_bytes(1, paired));
+    if (batch_bytes(plan.batch_size, paired) * threads > available)
+      plan.max_batches = max<uint64_t>(1, available / batch_bytes(plan.batch_size, paired));
+  }
+  plan.reads_bytes = batch_bytes(plan.batch_size, paired) * plan.max_batches;
+  return true;
+}
+
+#endif
@@ -24,8 +24,13 @@
 
 #include "bloomfilter.h"
 #include "kmer_utils.hpp"
+#include "ReadCache.hpp"
+#include "Stats.hpp"
+#include <algorithm>
 #include <vector>
 #include <array>
+#include <atomic>
+#include <memory>
 
 using namespace std;
 
@@ -33,88 +38,261 @@ class ReadAnalyzer {
 public:
   typedef vector<assoc_t> output_t;
 
-  ReadAnalyzer(BF *_bf, const vector<string>& _legend_ID, uint _k, double _c, bool _only_single = false) :
-  bf(_bf), legend_ID(_legend_ID), k(_k), c(_c), only_single(_only_single) {}
+  /**
+   * If read_cache_bytes is not 0, the verdicts are cached (in that many
+   * bytes) and reads whose sequence has already been analyzed are not
+   * analyzed again. If kmer_cache_size is not 0, each thread keeps the
+   * ranges of ids of the last k-mers it looked up in a direct-mapped
+   * cache of (about) that many entries. If count_only is set, reads are
+   * not associated to genes but counted in the gene counters of stats.
+   * With a stride s > 1, only one k-mer out of s is looked up. With a
+   * window w >= k, reads (of at least 1.5w bases, the two mates joined
+   * by an N if paired) are classified in windows of w bases, so that
+   * long reads spanning several genes are associated to the genes of
+   * each window, within c of its bases.
+   **/
+  ReadAnalyzer(BF *_bf, const vector<string>& _legend_ID, uint _k, double _c, bool _only_single = false,
+               size_t read_cache_bytes = 0, size_t kmer_cache_size = 0, bool _count_only = false, uint _stride = 1,
+               size_t _window = 0) :
+  bf(_bf), legend_ID(_legend_ID), k(_k), c(_c), only_single(_only_single), count_only(_count_only),
+  stride(_stride), window(_window),
+  cache(read_cache_bytes > 0 ? new ReadCache(read_cache_bytes) : nullptr),
+  kmer_cache_bits(cache_bits(kmer_cache_size)), id(next_id()) {}
 
-  void operator()(const vector<elem_t>& reads, output_t& associations) const {
-    vector<int> genes_idx;
-    typedef pair<pair<unsigned int, unsigned int>, unsigned int> gene_cov_t;
+  void operator()(const vector<elem_t>& reads, output_t& associations, stats_t& stats) const {
+    lookup_counters_t counters;
+    uint64_t accepted = 0, cache_hits = 0;
+    kmer_cache_t &kc = thread_kmer_cache();
+    const size_t nassociations = associations.size();
+    vector<int> genes_idx, window_genes;
     map<int, gene_cov_t> classification_id;
     for(const auto & p : reads) {
-      classification_id.clear();
       const string& read_seq = p.first;
-      unsigned int len = 0;
-      for (unsigned int pos = 0; pos < read_seq.size(); ++pos) {
-        len += to_int[read_seq[pos]] > 0 ? 1 : 0;
+      uint64_t key = 0;
+      if (cache) {
+        key = xxh::xxhash<64>(read_seq.data(), read_seq.size(), 0);
+        if (cache->find(key, genes_idx)) {
+          ++cache_hits;
+          accepted += genes_idx.empty() ? 0 : 1;
+          associate(p, genes_idx, associations, stats);
+          continue;
+        }
       }
-      if(len >= k) {
-        int pos = 0;
-        uint64_t kmer = build_kmer(read_seq, pos, k);
-        if(kmer == (uint64_t)-1) continue;
-        uint64_t rckmer = revcompl(kmer, k);
-        auto id_kmer = bf->get_index(min(kmer, rckmer));
-        while (id_kmer.first <= id_kmer.second) {
-          auto& gene_cov = classification_id[*(id_kmer.first)];
-          gene_cov.first.first += min(k, pos - gene_cov.second);
-          gene_cov.first.second = 1;
-          gene_cov.second = pos - 1;
-          ++id_kmer.first;
+      bool accept;
+      if (window == 0 || read_seq.size() < window + window / 2) {
+        accept = classify(read_seq, 0, read_seq.size(), classification_id, genes_idx, kc, counters)
+          && (!only_single || genes_idx.size() == 1);
+      } else {
+        // the read is associated to the genes of its accepted windows,
+        // the last window taking the remainder shorter than half a window
+        genes_idx.clear();
+        for (size_t from = 0, to = 0; to < read_seq.size(); from = to) {
+          to = read_seq.size() - from < window + window / 2 ? read_seq.size() : from + window;
+          if (classify(read_seq, from, to, classification_id, window_genes, kc, counters))
+            genes_idx.insert(genes_idx.end(), window_genes.begin(), window_genes.end());
         }
+        sort(genes_idx.begin(), genes_idx.end());
+        genes_idx.erase(unique(genes_idx.begin(), genes_idx.end()), genes_idx.end());
+        accept = !genes_idx.empty() && (!only_single || genes_idx.size() == 1);
+      }
 
-        for (; pos < (int)read_seq.size(); ++pos) {
-          uint8_t new_char = to_int[read_seq[pos]];
-          if(new_char == 0) { // Found a char different from A, C, G, T
-            ++pos; // we skip this character then we build a new kmer
-            kmer = build_kmer(read_seq, pos, k);
-            if(kmer == (uint64_t)-1) break;
-            rckmer = revcompl(kmer, k);
-            --pos; // p must point to the ending position of the kmer, it will be incremented by the for
-          } else {
-            --new_char; // A is 1 but it should be 0
-            kmer = lsappend(kmer, new_char, k);
-            rckmer = rsprepend(rckmer, reverse_char(new_char), k);
-          }
-          id_kmer = bf->get_index(min(kmer, rckmer));
-          // cerr << "POS: " << pos << endl;
-          while (id_kmer.first <= id_kmer.second) {
-            auto& gene_cov = classification_id[*(id_kmer.first)];
-            gene_cov.first.first += min(k, pos - gene_cov.second);
-            gene_cov.first.second += 1;
-            // cerr << "gid=" << gene_id << "\tPREV_POS=" << gene_cov.second << "\tNEW_COV=" << gene_cov.first.first << "," << gene_cov.first.second << endl;
-            gene_cov.second = pos;
-            ++id_kmer.first;
-          }
-        }
+      if (cache) {
+        if (!accept) genes_idx.clear();
+        cache->insert(key, genes_idx);
       }
+      if(accept) {
+        accepted += genes_idx.empty() ? 0 : 1;
+        associate(p, genes_idx, associations, stats);
+      }
+    }
+    stats.reads += reads.size();
+    stats.reads_accepted += accepted;
+    stats.associations += associations.size() - nassociations;
+    stats.kmer_lookups += counters.lookups;
+    stats.bloom_hits += counters.hits;
+    stats.empty_range_hits += counters.empty_range_hits;
+    stats.ids_retrieved += counters.ids;
+    stats.kmer_cache_hits += counters.kmer_cache_hits;
+    if (cache) {
+      stats.read_cache_lookups += reads.size();
+      stats.read_cache_hits += cache_hits;
+    }
+  }
 
-      unsigned int max = 0;
-      unsigned int maxk = 0;
-      genes_idx.clear();
-      for(auto it=classification_id.cbegin(); it!=classification_id.cend(); ++it) {
-        if(it->second.first.first == max && it->second.first.second == maxk) {
-          genes_idx.push_back(it->first);
-        } else if(it->second.first.first > max || (it->second.first.first == max && it->second.first.second > maxk)) {
-          genes_idx.clear();
-          max = it->second.first.first;
-          maxk = it->second.first.second;
-          genes_idx.push_back(it->first);
-        }
+private:
+  typedef pair<BF::index_kmer_t::const_iterator, BF::index_kmer_t::const_iterator> range_t;
+  // bases covered by the k-mers of a gene and number of k-mers, position after the last one
+  typedef pair<pair<unsigned int, unsigned int>, unsigned int> gene_cov_t;
+
+  // Lookups of a batch, added to the stats at its end
+  struct lookup_counters_t {
+    uint64_t lookups = 0, hits = 0, empty_range_hits = 0, ids = 0, kmer_cache_hits = 0;
+  };
+
+  // Cache of the k-mers looked up by a thread, valid for analyzer id only
+  struct kmer_cache_t {
+    uint64_t id = 0;
+    vector<pair<uint64_t, range_t>> slots;
+  };
+
+  static uint64_t next_id() {
+    static atomic<uint64_t> ids(0);
+    return ++ids;
+  }
+
+  static int cache_bits(const size_t size) {
+    int bits = 0;
+    while (((size_t)1 << bits) < size) ++bits;
+    return size == 0 ? -1 : bits;
+  }
+
+  kmer_cache_t &thread_kmer_cache() const {
+    static thread_local kmer_cache_t kc;
+    if (kc.id != id) {
+      kc.id = id;
+      // no k-mer has all the 63 low bits set, hence slots start empty
+      kc.slots.assign(kmer_cache_bits < 0 ? 0 : (size_t)1 << kmer_cache_bits, { ~(uint64_t)0, range_t() });
+    }
+    return kc;
+  }
+
+  /**
+   * Classifies read_seq[from, to), looking up the k-mers ending there
+   * (those ending at the first bases start before from, so that a
+   * window is covered as it would be in the whole read): genes_idx gets
+   * the genes covering the most bases of the range (then, having the
+   * most k-mers), and true is returned if they cover at least c of its
+   * bases. With a stride s, only the k-mers ending at multiples of s
+   * and the last one before an N (or the end) are looked up: each of
+   * them stands for the k-mers since the previous one, so that the
+   * coverage is estimated in the same way for every s, and is exact
+   * for s = 1.
+   **/
+  bool classify(const string &read_seq, const int from, const int to, map<int, gene_cov_t> &classification_id,
+                vector<int> &genes_idx, kmer_cache_t &kc, lookup_counters_t &counters) const {
+    classification_id.clear();
+    genes_idx.clear();
+    unsigned int len = 0;
+    for (int pos = from; pos < to; ++pos) {
+      len += to_int[read_seq[pos]] > 0 ? 1 : 0;
+    }
+    int prev = 0; // end of the previous k-mer looked up (or before the first one) in the run
+    auto look_up = [&](const uint64_t kmer, const uint64_t rckmer, const int end, const bool last) {
+      if (end % stride != 0 && !last)
+        return;
+      // the k-mers ending in (prev, end] cover the bases [prev + 2 - k, end], counted from from
+      const unsigned int span = end + 1 - max(prev + 2 - static_cast<int>(k), from);
+      auto id_kmer = lookup(min(kmer, rckmer), kc, counters);
+      while (id_kmer.first <= id_kmer.second) {
+        auto& gene_cov = classification_id[*(id_kmer.first)];
+        gene_cov.first.first += min(span, static_cast<unsigned int>(end + 1) - gene_cov.second);
+        gene_cov.first.second += end - prev;
+        gene_cov.second = end + 1;
+        ++id_kmer.first;
       }
+      prev = end;
+    };
+    // the k-mer ending at end is the last one before an N or the end
+    auto last_kmer = [&](const int end) { return end + 1 == to || to_int[read_seq[end + 1]] == 0; };
+    if(len > 0) {
+      int pos = max(0, from - static_cast<int>(k) + 1);
+      uint64_t kmer = build_kmer(read_seq, pos, k);
+      if(kmer == (uint64_t)-1 || pos > to) return false;
+      uint64_t rckmer = revcompl(kmer, k);
+      prev = pos - 2;
+      look_up(kmer, rckmer, pos - 1, last_kmer(pos - 1));
 
-      if(max >= c*len && (!only_single || genes_idx.size() == 1)) {
-        for(const auto idx : genes_idx) {
-          associations.push_back({ legend_ID[idx], std::move(get<1>(p)) });
+      for (; pos < to; ++pos) {
+        uint8_t new_char = to_int[read_seq[pos]];
+        if(new_char == 0) { // Found a char different from A, C, G, T
+          ++pos; // we skip this character then we build a new kmer
+          kmer = build_kmer(read_seq, pos, k);
+          if(kmer == (uint64_t)-1 || pos > to) break;
+          rckmer = revcompl(kmer, k);
+          --pos; // p must point to the ending position of the kmer, it will be incremented by the for
+          prev = pos - 1;
+        } else {
+          --new_char; // A is 1 but it should be 0
+          kmer = lsappend(kmer, new_char, k);
+          rckmer = rsprepend(rckmer, reverse_char(new_char), k);
         }
+        look_up(kmer, rckmer, pos, last_kmer(pos));
       }
     }
+
+    unsigned int max = 0;
+    unsigned int maxk = 0;
+    for(auto it=classification_id.cbegin(); it!=classification_id.cend(); ++it) {
+      if(it->second.first.first == max && it->second.first.second == maxk) {
+        genes_idx.push_back(it->first);
+      } else if(it->second.first.first > max || (it->second.first.first == max && it->second.first.second > maxk)) {
+        genes_idx.clear();
+        max = it->second.first.first;
+        maxk = it->second.first.second;
+        genes_idx.push_back(it->first);
+      }
+    }
+
+    return max >= c*len;
+  }
+
+  void associate(const elem_t &read, const vector<int> &genes, output_t &associations, stats_t &stats) const {
+    if (count_only) {
+      stats.count_genes(genes, legend_ID.size());
+      stats.associations += genes.size();
+      return;
+    }
+    for(const auto idx : genes) {
+      associations.push_back({ legend_ID[idx], std::move(get<1>(read)) });
+    }
+  }
+
+  /**
+   * Looks up the ids of kmer, through the k-mer cache of the thread if
+   * any, and counts the lookup in counters. In the cache, the top bit
+   * of a key (unused by the k-mers, as k < 32) records whether the
+   * k-mer is in the Bloom filter.
+   **/
+  range_t lookup(const uint64_t kmer, kmer_cache_t &kc, lookup_counters_t &counters) const {
+    static const uint64_t IN_FILTER = (uint64_t)1 << 63;
+    range_t range;
+    bool in_filter;
+    if (kc.slots.empty()) {
+      range = bf->get_index(kmer, in_filter);
+    } else {
+      // multiplicative hashing: the top bits select the slot
+      auto &slot = kc.slots[kmer_cache_bits == 0 ? 0 : (kmer * 0x9E3779B97F4A7C15ULL) >> (64 - kmer_cache_bits)];
+      if ((slot.first & ~IN_FILTER) == kmer) {
+        ++counters.kmer_cache_hits;
+      } else {
+        slot.second = bf->get_index(kmer, in_filter);
+        slot.first = kmer | (in_filter ? IN_FILTER : 0);
+      }
+      range = slot.second;
+      in_filter = (slot.first & IN_FILTER) != 0;
+    }
+    ++counters.lookups;
+    if (in_filter) {
+      ++counters.hits;
+      if (range.first > range.second)
+        ++counters.empty_range_hits;
+      else
+        counters.ids += range.second - range.first + 1;
+    }
+    return range;
   }
 
-private:
   BF * const bf;
   const vector<string>& legend_ID;
   const uint k;
   const double c;
   const bool only_single;
+  const bool count_only;
+  const int stride;
+  const size_t window; // 0: reads are classified as a whole
+  const unique_ptr<ReadCache> cache;
+  const int kmer_cache_bits; // -1: no cache
+  const uint64_t id;
 
 };
 
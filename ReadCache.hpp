@@ -0,0 +1,109 @@
+/**
+ * shark - Mapping-free filtering of useless RNA-Seq reads
+ * Copyright (C) 2020 Tamara Ceccato, Luca Denti, Yuri Pirola, Marco Previtali
+ *
+ * This file is part of shark.
+ *
+ * shark is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shark is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shark; see the file LICENSE. If not, see
+ * <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef READ_CACHE_HPP
+#define READ_CACHE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/**
+ * Bounded cache of the verdicts of the analysis, shared by the threads
+ * and keyed by a 64-bit hash of the (masked) sequence of a read (pair):
+ * a verdict is the list of genes the read is associated to (empty if
+ * rejected), at most MAX_GENES of them. The cache is direct-mapped and
+ * lock-free: each slot is protected by a sequence lock, a reader
+ * retrying nothing (a slot being written is a miss) and a writer
+ * giving up if the slot is busy. Newer entries replace older ones.
+ **/
+class ReadCache {
+public:
+  static const size_t MAX_GENES = 3;
+
+  explicit ReadCache(const size_t bytes) : mask(slots_for(bytes) - 1), slots(new slot_t[mask + 1]) {
+    for (size_t i = 0; i <= mask; ++i) {
+      slots[i].seq.store(0, std::memory_order_relaxed);
+      slots[i].key.store(0, std::memory_order_relaxed);
+      slots[i].value.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  // Looks key up, filling genes with its verdict on a hit
+  bool find(uint64_t key, std::vector<int> &genes) const {
+    key = key != 0 ? key : 1; // 0 marks an empty slot
+    const slot_t &slot = slots[key & mask];
+    const uint32_t seq = slot.seq.load(std::memory_order_acquire);
+    if (seq & 1)
+      return false;
+    const uint64_t k = slot.key.load(std::memory_order_relaxed);
+    const uint64_t v = slot.value.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (k != key || slot.seq.load(std::memory_order_relaxed) != seq)
+      return false;
+    genes.clear();
+    for (uint64_t i = 0; i < (v & 3); ++i)
+      genes.push_back((v >> (16 * (i + 1))) & 0xFFFF);
+    return true;
+  }
+
+  // Stores the verdict of key, unless it has too many genes or the slot is busy
+  void insert(uint64_t key, const std::vector<int> &genes) {
+    if (genes.size() > MAX_GENES)
+      return;
+    key = key != 0 ? key : 1;
+    uint64_t v = genes.size();
+    for (size_t i = 0; i < genes.size(); ++i)
+      v |= static_cast<uint64_t>(genes[i] & 0xFFFF) << (16 * (i + 1));
+    slot_t &slot = slots[key & mask];
+    uint32_t seq = slot.seq.load(std::memory_order_relaxed);
+    if ((seq & 1) || !slot.seq.compare_exchange_strong(seq, seq + 1, std::memory_order_acquire))
+      return;
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.key.store(key, std::memory_order_relaxed);
+    slot.value.store(v, std::memory_order_relaxed);
+    slot.seq.store(seq + 2, std::memory_order_release);
+  }
+
+private:
+  struct slot_t {
+    std::atomic<uint32_t> seq; // odd while the slot is written
+    std::atomic<uint64_t> key;
+    std::atomic<uint64_t> value; // number of genes (2 bits), then the genes (16 bits each)
+  };
+
+  // Largest power of 2 of slots fitting in bytes (at least 1024)
+  static size_t slots_for(const size_t bytes) {
+    size_t n = 1024;
+    while (n * 2 * sizeof(slot_t) <= bytes) n *= 2;
+    return n;
+  }
+
+  ReadCache(const ReadCache &) = delete;
+  const ReadCache &operator=(const ReadCache &) = delete;
+
+  const size_t mask;
+  std::unique_ptr<slot_t[]> slots;
+};
+
+#endif
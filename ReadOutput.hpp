@@ -30,8 +30,8 @@
 
 class ReadOutput {
 public:
-  ReadOutput(FILE* const _out1 = nullptr, FILE* const _out2 = nullptr)
-    : out1(_out1), out2(_out2)
+  ReadOutput(FILE* const _out1 = nullptr, FILE* const _out2 = nullptr, FILE* const _assoc = stdout)
+    : out1(_out1), out2(_out2), assoc(_assoc)
   { }
 
   void operator()(const std::vector<assoc_t>& associations) {
@@ -40,7 +40,7 @@ public:
     for(const auto & a : associations) {
       const sharseq_t& s1 = a.second.first;
       const sharseq_t& s2 = a.second.second;
-      printf("%s %s\n", s1.id.c_str(), a.first.c_str());
+      fprintf(assoc, "%s %s\n", s1.id.c_str(), a.first.c_str());
       if (out1 != nullptr && previd != s1.id)
         fprintf(out1, "@%s\n%s\n+\n%s\n", s1.id.c_str(), s1.seq.c_str(), s1.qual.c_str());
       if (out2 != nullptr && previd != s1.id)
@@ -52,6 +52,7 @@ public:
 private:
   FILE* const out1;
   FILE* const out2;
+  FILE* const assoc;
   std::mutex mtx;
 };
 
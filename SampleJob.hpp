@@ -0,0 +1,379 @@
+/**
+ * shark - Mapping-free filtering of useless RNA-Seq reads
+ * Copyright (C) 2020 Tamara Ceccato, Luca Denti, Yuri Pirola, Marco Previtali
+ *
+ * This file is part of shark.
+ *
+ * shark is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shark is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shark; see the file LICENSE. If not, see
+ * <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef SAMPLE_JOB_HPP
+#define SAMPLE_JOB_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "BoundedQueue.hpp"
+#include "FastqParser.hpp"
+#include "FastqSplitter.hpp"
+#include "ReadAnalyzer.hpp"
+#include "ReadOutput.hpp"
+#include "Stats.hpp"
+#include "io_utils.hpp"
+
+using namespace std;
+
+// Input and output paths of a sample (empty strings for missing files)
+struct sample_t {
+  string sample1, sample2, out1, out2, assoc;
+};
+
+/**
+ * Reads a batch manifest. Each non-empty line (lines starting with #
+ * are comments) describes a sample as
+ *   <sample1> <sample2> <out1> <out2> [<associations>]
+ * where "-" stands for a missing second sample/output. If the last
+ * column is missing, associations are printed to stdout.
+ **/
+vector<sample_t> read_manifest(const string &path) {
+  ifstream manifest(path);
+  if (!manifest) {
+    cerr << "shark: cannot open manifest " << path << "." << endl
+         << "aborting..." << endl;
+    exit(EXIT_FAILURE);
+  }
+  vector<sample_t> samples;
+  string line;
+  for (int nline = 1; getline(manifest, line); ++nline) {
+    istringstream fields(line);
+    vector<string> cols;
+    string col;
+    while (fields >> col) cols.push_back(col == "-" ? "" : col);
+    if (cols.empty() || cols[0][0] == '#') continue;
+    if ((cols.size() != 4 && cols.size() != 5) || cols[0].empty() || cols[2].empty()
+        || cols[1].empty() != cols[3].empty()) {
+      cerr << "shark: malformed line " << nline << " in manifest " << path << "." << endl
+           << "aborting..." << endl;
+      exit(EXIT_FAILURE);
+    }
+    samples.push_back({ cols[0], cols[1], cols[2], cols[3], cols.size() == 5 ? cols[4] : "" });
+  }
+  return samples;
+}
+
+/**
+ * Batches of reads shared by the samples under analysis, so that at
+ * most max_batches of them are in memory even when the analysis of a
+ * sample overlaps with the next one. Threads with nothing to do wait
+ * for progress (a batch read, analyzed or freed, in any sample).
+ **/
+class BatchPool {
+public:
+  struct batch_t {
+    FastqSplitter::output_t reads;
+    ReadAnalyzer::output_t associations;
+  };
+
+  explicit BatchPool(const int max_batches)
+    : batches(max(max_batches, 1)), free_batches(batches.size()), progress(0)
+  {
+    for (auto &b : batches)
+      free_batches.try_push(&b);
+  }
+
+  size_t size() const { return batches.size(); }
+
+  bool try_acquire(batch_t *&b) { return free_batches.try_pop(b); }
+
+  void release(batch_t *b) {
+    b->reads.clear();
+    b->associations.clear();
+    free_batches.try_push(b);
+  }
+
+  // Current progress, to be passed to wait before looking for work
+  uint64_t seen() const { return progress.load(std::memory_order_acquire); }
+
+  void notify() {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      progress.fetch_add(1, std::memory_order_release);
+    }
+    cv.notify_all();
+  }
+
+  // Waits for progress since seen
+  void wait(const uint64_t seen) {
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait(lock, [&] { return progress.load(std::memory_order_relaxed) != seen; });
+  }
+
+private:
+  BatchPool(const BatchPool &) = delete;
+  const BatchPool &operator=(const BatchPool &) = delete;
+
+  vector<batch_t> batches;
+  // never fills up, as it can hold all the batches
+  BoundedQueue<batch_t *> free_batches;
+  std::atomic<uint64_t> progress;
+  std::mutex mtx;
+  std::condition_variable cv;
+};
+
+/**
+ * Files and pipeline stages (splitter and output) of a sample under
+ * analysis. Files are opened by the constructor (or handed over to it)
+ * and closed by the destructor. Batches of reads are taken from the
+ * pool: they move from the splitter to the analysis and then to the
+ * output through lock-free queues, and back to the pool once written.
+ **/
+class SampleJob {
+public:
+  SampleJob(const sample_t &s, const int maxnum, BatchPool &pool, const char min_quality)
+    : SampleJob(open_sample(s.sample1),
+                s.sample2.empty() ? nullptr : open_sample(s.sample2),
+                s.out1.empty() ? nullptr : open_output(s.out1),
+                s.out2.empty() ? nullptr : open_output(s.out2),
+                s.assoc.empty() ? stdout : open_output(s.assoc),
+                maxnum, pool, min_quality, s.sample1, s.sample2)
+  { }
+
+  // _fq1 and _fq2 parse the samples at path1 and path2 (see try_open_sample)
+  SampleJob(FastqParser * const _fq1, FastqParser * const _fq2, FILE * const _out1, FILE * const _out2,
+            FILE * const _assoc, const int maxnum, BatchPool &_pool, const char min_quality,
+            const string &_path1, const string &_path2)
+    : path1(_path1),
+      path2(_path2),
+      fq1(_fq1),
+      fq2(_fq2),
+      out1(_out1),
+      out2(_out2),
+      assoc(_assoc),
+      pool(_pool),
+      read_batches(pool.size()),
+      analyzed_batches(pool.size()),
+      exhausted(false),
+      fs(fq1, fq2, maxnum, min_quality, out1 != nullptr),
+      ro(out1, out2, assoc)
+  { }
+
+  ~SampleJob() {
+    // batches left by an interrupted analysis
+    batch_t *b;
+    while (read_batches.try_pop(b) || analyzed_batches.try_pop(b))
+      pool.release(b);
+    pool.notify();
+
+    delete fq1; // closes the samples
+    delete fq2;
+    if (out1 != nullptr) fclose(out1);
+    if (out2 != nullptr) fclose(out2);
+    if (assoc != stdout) fclose(assoc);
+    else fflush(stdout);
+  }
+
+  /**
+   * Analyzes batches of reads until the sample is exhausted. Threads
+   * never wait for the splitter or for the output: they analyze the
+   * batches already read, read a new one if the splitter is free and a
+   * batch is available, and write the analyzed ones if the output is
+   * free. When all the batches are in flight, they write what is left
+   * (waiting for the output), then sleep until a batch is read or
+   * freed. Before leaving, each thread waits for the output to write
+   * what is left.
+   **/
+  void run(const ReadAnalyzer &ra, stats_t &stats) {
+    batch_t *b;
+    while (true) {
+      const uint64_t seen = pool.seen();
+      const bool done = exhausted.load(std::memory_order_acquire);
+      if (read_batches.try_pop(b)) {
+        const auto start = chrono::steady_clock::now();
+        ra(b->reads, b->associations, stats);
+        stats.analysis_ns += elapsed_ns(start);
+        analyzed_batches.try_push(b);
+        write(stats, false);
+        continue;
+      }
+      if (done) {
+        write(stats, true);
+        return;
+      }
+      if (read(stats)) continue;
+      // all the batches are in flight: sleep, unless there is something to write
+      if (!write(stats, true))
+        pool.wait(seen);
+    }
+  }
+
+  // Empty, or why the sample could not be read to the end
+  string error() const {
+    if (fq1->failed()) return "cannot read " + input_name(path1);
+    if (fq2 != nullptr && fq2->failed()) return "cannot read " + input_name(path2);
+    return "";
+  }
+
+  /**
+   * Reads batches until all of them are in flight (or the sample is
+   * exhausted), e.g. in the background while the index is built, so
+   * that the analysis starts with a full queue.
+   **/
+  void prefetch(stats_t &stats) {
+    while (read(stats)) { }
+  }
+
+private:
+  typedef BatchPool::batch_t batch_t;
+
+  // Reads a batch, if the splitter and a batch are available
+  bool read(stats_t &stats) {
+    std::unique_lock<std::mutex> lock(read_mtx, std::try_to_lock);
+    batch_t *b;
+    if (!lock.owns_lock() || exhausted.load(std::memory_order_relaxed) || !pool.try_acquire(b))
+      return false;
+    const auto start = chrono::steady_clock::now();
+    fs(b->reads);
+    stats.splitter_ns += elapsed_ns(start);
+    if (b->reads.empty()) {
+      pool.release(b);
+      exhausted.store(true, std::memory_order_release);
+    } else {
+      read_batches.try_push(b);
+    }
+    lock.unlock();
+    pool.notify();
+    return true;
+  }
+
+  /**
+   * Writes the analyzed batches, waiting for the output if wait is set.
+   * Returns true if any batch was written.
+   **/
+  bool write(stats_t &stats, const bool wait) {
+    std::unique_lock<std::mutex> lock(write_mtx, std::defer_lock);
+    if (wait) lock.lock();
+    else if (!lock.try_lock()) return false;
+    batch_t *b;
+    bool written = false;
+    while (analyzed_batches.try_pop(b)) {
+      const auto start = chrono::steady_clock::now();
+      ro(b->associations);
+      stats.output_ns += elapsed_ns(start);
+      pool.release(b);
+      written = true;
+    }
+    lock.unlock();
+    if (written)
+      pool.notify();
+    return written;
+  }
+
+  SampleJob() = delete;
+  SampleJob(const SampleJob &) = delete;
+  const SampleJob &operator=(const SampleJob &) = delete;
+
+  const string path1;
+  const string path2;
+  FastqParser * const fq1;
+  FastqParser * const fq2;
+  FILE * const out1;
+  FILE * const out2;
+  FILE * const assoc;
+  BatchPool &pool;
+  // the queues never fill up, as each of them can hold all the batches
+  BoundedQueue<batch_t *> read_batches;
+  BoundedQueue<batch_t *> analyzed_batches;
+  std::atomic<bool> exhausted;
+  std::mutex read_mtx;
+  std::mutex write_mtx;
+
+public:
+  FastqSplitter fs;
+  ReadOutput ro;
+};
+
+/**
+ * Hands out the samples of a batch to the analysis threads. Threads
+ * visit the samples in order: the first thread reaching a sample opens
+ * it, and the first thread that finds it exhausted moves on to the
+ * next one, so that opening and reading the next sample overlaps with
+ * the last batches of the current one (the samples share a pool of
+ * max_batches batches). The last thread leaving a sample closes it.
+ **/
+class SampleScheduler {
+public:
+  SampleScheduler(const vector<sample_t> &_samples, const int _maxnum, const int max_batches,
+                  const char _min_quality)
+    : samples(_samples), maxnum(_maxnum), pool(max_batches), min_quality(_min_quality),
+      jobs(_samples.size()), workers(_samples.size(), 0), done(_samples.size(), false)
+  { }
+
+  size_t size() const { return samples.size(); }
+
+  // Opens the i-th sample in advance (e.g., to check it before indexing)
+  void open(const size_t i) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (!jobs[i]) jobs[i].reset(new SampleJob(samples[i], maxnum, pool, min_quality));
+  }
+
+  // Opens the i-th sample and fills its batches of reads
+  void prefetch(const size_t i, stats_t &stats) {
+    open(i);
+    SampleJob *job;
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      job = jobs[i].get();
+    }
+    job->prefetch(stats);
+  }
+
+  // Returns the i-th sample, or nullptr if it has been already exhausted
+  SampleJob *enter(const size_t i) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (done[i]) return nullptr;
+    if (!jobs[i]) jobs[i].reset(new SampleJob(samples[i], maxnum, pool, min_quality));
+    ++workers[i];
+    return jobs[i].get();
+  }
+
+  // Returns true if the calling thread was the last one working on the sample
+  bool leave(const size_t i) {
+    std::lock_guard<std::mutex> lock(mtx);
+    done[i] = true;
+    if (--workers[i] > 0) return false;
+    jobs[i].reset();
+    return true;
+  }
+
+private:
+  const vector<sample_t> samples;
+  const int maxnum;
+  BatchPool pool;
+  const char min_quality;
+  vector<unique_ptr<SampleJob>> jobs;
+  vector<int> workers;
+  vector<bool> done;
+  std::mutex mtx;
+};
+
+#endif
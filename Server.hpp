@@ -0,0 +1,456 @@
+/**
+ * shark - Mapping-free filtering of useless RNA-Seq reads
+ * Copyright (C) 2020 Tamara Ceccato, Luca Denti, Yuri Pirola, Marco Previtali
+ *
+ * This file is part of shark.
+ *
+ * shark is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shark is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shark; see the file LICENSE. If not, see
+ * <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef SERVER_HPP
+#define SERVER_HPP
+
+#include <atomic>
+#include <climits>
+#include <condition_variable>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "bloomfilter.h"
+#include "ReadAnalyzer.hpp"
+#include "SampleJob.hpp"
+#include "io_utils.hpp"
+#include "memory_utils.hpp"
+
+using namespace std;
+
+/**
+ * Requests and replies exchanged on the server socket are plain text.
+ * A request is a list of "<key> <value>" lines ended by an empty line
+ * (keys: index, sample1, sample2, out1, out2, confidence, min-quality,
+ * single, stride, window); the client attaches its stdout to the request (SCM_RIGHTS)
+ * and the server prints the associations there. The server replies
+ * with a single line, "OK" when the job is completed or "ERROR <msg>".
+ **/
+namespace server_protocol {
+
+  bool make_address(const string &path, sockaddr_un &addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) return false;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    return true;
+  }
+
+  bool write_all(const int fd, const string &msg) {
+    size_t sent = 0;
+    while (sent < msg.size()) {
+      const ssize_t n = send(fd, msg.data() + sent, msg.size() - sent, MSG_NOSIGNAL);
+      if (n <= 0) return false;
+      sent += n;
+    }
+    return true;
+  }
+
+  // Sends the first bytes of msg together with the file descriptor fd
+  bool send_with_fd(const int sock, const string &msg, const int fd) {
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    iovec iov = { const_cast<char *>(msg.data()), msg.size() };
+    msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    const ssize_t n = sendmsg(sock, &hdr, MSG_NOSIGNAL);
+    if (n <= 0) return false;
+    return write_all(sock, msg.substr(n));
+  }
+
+  // Reads a request up to the empty line, collecting the first attached descriptor (if any): any other is closed
+  bool read_request(const int sock, map<string, string> &request, int &fd) {
+    fd = -1;
+    string data;
+    char buf[4096];
+    char control[CMSG_SPACE(4 * sizeof(int))];
+    while (data.find("\n\n") == string::npos) {
+      iovec iov = { buf, sizeof(buf) };
+      msghdr hdr;
+      memset(&hdr, 0, sizeof(hdr));
+      hdr.msg_iov = &iov;
+      hdr.msg_iovlen = 1;
+      hdr.msg_control = control;
+      hdr.msg_controllen = sizeof(control);
+      const ssize_t n = recvmsg(sock, &hdr, MSG_CMSG_CLOEXEC);
+      for (cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg != nullptr; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+          continue;
+        const size_t nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < nfds; ++i) {
+          int received;
+          memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+          if (fd < 0) fd = received;
+          else close(received);
+        }
+      }
+      if (n <= 0) return false;
+      data.append(buf, n);
+    }
+    istringstream lines(data.substr(0, data.find("\n\n")));
+    string line;
+    while (getline(lines, line)) {
+      const size_t sep = line.find(' ');
+      if (sep == string::npos) return false;
+      request[line.substr(0, sep)] = line.substr(sep + 1);
+    }
+    return true;
+  }
+
+}
+
+/**
+ * Long-running process keeping one or more indexes in memory and
+ * analyzing the samples submitted on a Unix domain socket. Jobs are
+ * queued and served by a single pool of threads: as in batch mode, all
+ * threads work on the oldest job and move on to the next one as soon
+ * as they find it exhausted.
+ **/
+class Server {
+public:
+  struct index_t {
+    unique_ptr<BF> bloom;
+    vector<string> legend_ID;
+  };
+
+  Server(const string &_socket_path, const int _nthreads, const size_t _batch_size, const size_t _read_cache_bytes,
+         const size_t _kmer_cache_size, const bool _verbose)
+    : socket_path(_socket_path), nthreads(_nthreads), batch_size(_batch_size), read_cache_bytes(_read_cache_bytes),
+      kmer_cache_size(_kmer_cache_size), verbose(_verbose),
+      pool(_nthreads), stopping(false), njobs(0)
+  { }
+
+  // Adds an index named after the file name of the reference (to be built by the caller)
+  index_t &add_index(const string &fasta_path, const uint _k) {
+    const string name = fasta_path.substr(fasta_path.find_last_of('/') + 1);
+    if (indexes.count(name) != 0) {
+      cerr << "shark: two references are named " << name << "." << endl
+           << "aborting..." << endl;
+      exit(EXIT_FAILURE);
+    }
+    k = _k;
+    index_t &index = indexes[name];
+    index.legend_ID.reserve(100);
+    return index;
+  }
+
+  // Serves jobs until SIGINT/SIGTERM is received
+  int run() {
+    sockaddr_un addr;
+    if (!server_protocol::make_address(socket_path, addr)) {
+      cerr << "shark: socket path " << socket_path << " is too long." << endl
+           << "aborting..." << endl;
+      return EXIT_FAILURE;
+    }
+    struct stat sock_stat;
+    if (stat(socket_path.c_str(), &sock_stat) == 0 && S_ISSOCK(sock_stat.st_mode))
+      unlink(socket_path.c_str()); // stale socket of a previous server
+    const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 16) != 0) {
+      cerr << "shark: cannot listen on " << socket_path << " (" << strerror(errno) << ")." << endl
+           << "aborting..." << endl;
+      return EXIT_FAILURE;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    std::vector<std::thread> threads;
+    while (static_cast<int>(threads.size()) < nthreads)
+      threads.emplace_back([this, i = threads.size()] { pin_thread(i); worker(); });
+    cerr << "[shark/serve] Listening on " << socket_path << " (" << indexes.size() << " indexes)" << endl;
+
+    pollfd pfd = { listener, POLLIN, 0 };
+    while (!stop_requested()) {
+      if (poll(&pfd, 1, 500) <= 0 || (pfd.revents & POLLIN) == 0) continue;
+      const int conn = accept(listener, nullptr, nullptr);
+      if (conn < 0) continue;
+      const timeval timeout = { 10, 0 };
+      setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      accept_job(conn);
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      stopping = true;
+    }
+    cv.notify_all();
+    for (auto &t : threads)
+      t.join();
+    close(listener);
+    unlink(socket_path.c_str());
+    cerr << "[shark/serve] Stopped after " << njobs << " jobs" << endl;
+    return EXIT_SUCCESS;
+  }
+
+private:
+  struct job_t {
+    size_t id;
+    int conn;
+    string name;
+    unique_ptr<ReadAnalyzer> ra;
+    map<string, string> req;
+    char min_quality;
+    int out_fd;
+    unique_ptr<SampleJob> sample; // opened when a worker picks the job
+    int workers;
+    bool done;
+  };
+
+  const string socket_path;
+  const int nthreads;
+  const size_t batch_size;
+  const size_t read_cache_bytes; // of each job
+  const size_t kmer_cache_size;
+  const bool verbose;
+  uint k;
+  map<string, index_t> indexes;
+  BatchPool pool; // shared by the jobs
+  list<shared_ptr<job_t>> pending;
+  bool stopping;
+  size_t njobs;
+  std::mutex mtx;
+  std::condition_variable cv;
+
+  static volatile sig_atomic_t &stop_flag() {
+    static volatile sig_atomic_t flag = 0;
+    return flag;
+  }
+
+  static void on_signal(int) { stop_flag() = 1; }
+
+  static bool stop_requested() { return stop_flag() != 0; }
+
+  static void reply(const int conn, const string &msg) {
+    server_protocol::write_all(conn, msg + "\n");
+    close(conn);
+  }
+
+  // Checks a request and queues the corresponding job
+  void accept_job(const int conn) {
+    map<string, string> req;
+    int out_fd;
+    if (!server_protocol::read_request(conn, req, out_fd)) {
+      if (out_fd >= 0) close(out_fd);
+      return reply(conn, "ERROR malformed request");
+    }
+    if (out_fd < 0)
+      return reply(conn, "ERROR missing output descriptor");
+
+    string error;
+    index_t *index = nullptr;
+    if (req["index"].empty() && indexes.size() == 1)
+      index = &indexes.begin()->second;
+    else if (indexes.count(req["index"]) != 0)
+      index = &indexes[req["index"]];
+    else
+      error = "unknown index " + req["index"];
+
+    double c = 0.6;
+    int mq = 0, stride = 1, window = 0;
+    if (error.empty()) {
+      istringstream(req["confidence"]) >> c;
+      istringstream(req["min-quality"]) >> mq;
+      if (!req["stride"].empty()) istringstream(req["stride"]) >> stride;
+      if (!req["window"].empty()) istringstream(req["window"]) >> window;
+      if (c < 0 || c > 1) error = "c must be in the range [0, 1]";
+      else if (mq < 0) error = "q must be a positive value";
+      else if (stride <= 0) error = "the stride must be a positive number of k-mers";
+      else if (window < 0) error = "the window must be a non-negative number of bases";
+      else if (window > 0 && window < static_cast<int>(k)) error = "the window must be at least as long as the k-mers";
+      else if (req["sample1"].empty() || req["sample1"][0] != '/'
+               || (!req["sample2"].empty() && req["sample2"][0] != '/'))
+        error = "sample paths must be absolute";
+    }
+
+    if (!error.empty()) {
+      close(out_fd);
+      return reply(conn, "ERROR " + error);
+    }
+
+    shared_ptr<job_t> job(new job_t());
+    job->conn = conn;
+    job->name = req["sample1"];
+    job->ra.reset(new ReadAnalyzer(index->bloom.get(), index->legend_ID, k, c, req["single"] == "1",
+                                   read_cache_bytes, kmer_cache_size, false, stride, window));
+    job->req = req;
+    job->min_quality = static_cast<char>(mq);
+    job->out_fd = out_fd;
+    job->workers = 0;
+    job->done = false;
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      job->id = ++njobs;
+      pending.push_back(job);
+    }
+    if (verbose)
+      cerr << "[shark/serve] Job " << job->id << " (" << job->name << ") queued" << endl;
+    cv.notify_all();
+  }
+
+  /**
+   * Opens the files of a job, so that queued jobs hold no buffers:
+   * false, setting error and closing what was opened, on failure.
+   **/
+  bool open_job(job_t &job, string &error) {
+    map<string, string> &req = job.req;
+    FastqParser *fq1 = try_open_sample(req["sample1"], error), *fq2 = nullptr;
+    FILE *out1 = nullptr, *out2 = nullptr, *assoc = nullptr;
+    if (error.empty() && !req["sample2"].empty()) fq2 = try_open_sample(req["sample2"], error);
+    if (error.empty() && !req["out1"].empty()) out1 = try_open_output(req["out1"], error);
+    if (error.empty() && !req["out2"].empty()) out2 = try_open_output(req["out2"], error);
+    if (error.empty() && (assoc = fdopen(job.out_fd, "w")) == nullptr) error = "cannot write associations";
+    if (!error.empty()) {
+      delete fq1;
+      delete fq2;
+      if (out1 != nullptr) fclose(out1);
+      if (out2 != nullptr) fclose(out2);
+      close(job.out_fd);
+      return false;
+    }
+    job.sample.reset(new SampleJob(fq1, fq2, out1, out2, assoc, batch_size, pool, job.min_quality,
+                                   req["sample1"], req["sample2"]));
+    return true;
+  }
+
+  void worker() {
+    while (true) {
+      shared_ptr<job_t> job;
+      string error;
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [this] { return stopping || !pending.empty(); });
+        if (pending.empty()) return;
+        job = pending.front();
+        if (!job->sample && !open_job(*job, error))
+          pending.pop_front();
+        else
+          ++job->workers;
+      }
+      if (!error.empty()) {
+        reply(job->conn, "ERROR " + error);
+        if (verbose)
+          cerr << "[shark/serve] Job " << job->id << " (" << job->name << ") failed: " << error << endl;
+        continue;
+      }
+      stats_t stats;
+      job->sample->run(*job->ra, stats);
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!job->done) {
+          job->done = true;
+          pending.remove(job);
+        }
+        if (--job->workers > 0) continue;
+      }
+      error = job->sample->error();
+      job->sample.reset(); // flushes and closes the outputs
+      reply(job->conn, error.empty() ? "OK" : "ERROR " + error);
+      if (verbose)
+        cerr << "[shark/serve] Job " << job->id << " (" << job->name << ") completed" << endl;
+    }
+  }
+};
+
+/**
+ * Client side of the server: submits a sample and waits for its
+ * completion, while the server prints the associations on our stdout.
+ **/
+int submit_job(const string &socket_path, const string &index_name, const sample_t &s,
+               const double c, const char min_quality, const bool single, const uint stride,
+               const size_t window) {
+  auto absolute = [](const string &path) {
+    if (path.empty() || path[0] == '/') return path;
+    char cwd[PATH_MAX];
+    return string(getcwd(cwd, sizeof(cwd)) != nullptr ? cwd : ".") + "/" + path;
+  };
+  if (s.sample1 == "-" || s.sample2 == "-") {
+    cerr << "shark: samples submitted to a server cannot be read from standard input." << endl
+         << "aborting..." << endl;
+    return EXIT_FAILURE;
+  }
+
+  ostringstream req;
+  req << "index " << index_name << "\n"
+      << "sample1 " << absolute(s.sample1) << "\n"
+      << "sample2 " << absolute(s.sample2) << "\n"
+      << "out1 " << absolute(s.out1) << "\n"
+      << "out2 " << absolute(s.out2) << "\n"
+      << "confidence " << c << "\n"
+      << "min-quality " << static_cast<int>(min_quality) << "\n"
+      << "single " << (single ? 1 : 0) << "\n"
+      << "stride " << stride << "\n"
+      << "window " << window << "\n\n";
+
+  sockaddr_un addr;
+  const int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (!server_protocol::make_address(socket_path, addr) || sock < 0
+      || connect(sock, (sockaddr *)&addr, sizeof(addr)) != 0) {
+    cerr << "shark: cannot connect to the server on " << socket_path << "." << endl
+         << "aborting..." << endl;
+    return EXIT_FAILURE;
+  }
+  fflush(stdout);
+  if (!server_protocol::send_with_fd(sock, req.str(), STDOUT_FILENO)) {
+    cerr << "shark: cannot submit the job." << endl
+         << "aborting..." << endl;
+    return EXIT_FAILURE;
+  }
+
+  string answer;
+  char buf[256];
+  ssize_t n;
+  while ((n = read(sock, buf, sizeof(buf))) > 0)
+    answer.append(buf, n);
+  close(sock);
+  if (answer.compare(0, 2, "OK") == 0) return EXIT_SUCCESS;
+  cerr << "shark: " << (answer.compare(0, 6, "ERROR ") == 0 ? answer.substr(6, answer.find('\n') - 6)
+                                                            : "the server closed the connection") << "." << endl
+       << "aborting..." << endl;
+  return EXIT_FAILURE;
+}
+
+#endif
@@ -0,0 +1,182 @@
+/**
+ * shark - Mapping-free filtering of useless RNA-Seq reads
+ * Copyright (C) 2020 Tamara Ceccato, Luca Denti, Yuri Pirola, Marco Previtali
+ *
+ * This file is part of shark.
+ *
+ * shark is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shark is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shark; see the file LICENSE. If not, see
+ * <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+ * Counters of a run. Each thread updates its own copy, which is merged
+ * into the global one (StatsCollector) when the thread ends.
+ **/
+struct stats_t {
+  // Reference indexing
+  uint64_t reference_kmers = 0;  // k-mers hashed into the Bloom filter (1st pass)
+  // Read analysis
+  uint64_t reads = 0;
+  uint64_t reads_accepted = 0;   // reads associated to at least a gene
+  uint64_t associations = 0;
+  uint64_t kmer_lookups = 0;
+  uint64_t bloom_hits = 0;       // lookups of k-mers in the Bloom filter
+  uint64_t empty_range_hits = 0; // Bloom hits whose range of ids is empty
+  uint64_t ids_retrieved = 0;    // total size of the ranges returned by the lookups
+  uint64_t kmer_cache_hits = 0;  // lookups answered by the k-mer caches of the threads
+  uint64_t read_cache_lookups = 0;
+  uint64_t read_cache_hits = 0;  // reads answered by the cache of verdicts
+  // Time (ns) spent by the analysis threads in each stage, waiting included
+  uint64_t splitter_ns = 0;
+  uint64_t analysis_ns = 0;
+  uint64_t output_ns = 0;
+  // Reads associated to each gene, alone (unique) or with others (multi), if counted
+  vector<uint64_t> gene_unique;
+  vector<uint64_t> gene_multi;
+
+  void count_genes(const vector<int> &genes, const size_t ngenes) {
+    if (gene_unique.size() < ngenes) {
+      gene_unique.resize(ngenes, 0);
+      gene_multi.resize(ngenes, 0);
+    }
+    if (genes.size() == 1)
+      ++gene_unique[genes[0]];
+    else
+      for (const auto g : genes)
+        ++gene_multi[g];
+  }
+
+  stats_t &operator+=(const stats_t &o) {
+    reference_kmers += o.reference_kmers;
+    reads += o.reads;
+    reads_accepted += o.reads_accepted;
+    associations += o.associations;
+    kmer_lookups += o.kmer_lookups;
+    bloom_hits += o.bloom_hits;
+    empty_range_hits += o.empty_range_hits;
+    ids_retrieved += o.ids_retrieved;
+    kmer_cache_hits += o.kmer_cache_hits;
+    read_cache_lookups += o.read_cache_lookups;
+    read_cache_hits += o.read_cache_hits;
+    splitter_ns += o.splitter_ns;
+    analysis_ns += o.analysis_ns;
+    output_ns += o.output_ns;
+    if (gene_unique.size() < o.gene_unique.size()) {
+      gene_unique.resize(o.gene_unique.size(), 0);
+      gene_multi.resize(o.gene_multi.size(), 0);
+    }
+    for (size_t g = 0; g < o.gene_unique.size(); ++g) {
+      gene_unique[g] += o.gene_unique[g];
+      gene_multi[g] += o.gene_multi[g];
+    }
+    return *this;
+  }
+};
+
+// Nanoseconds elapsed since start
+inline uint64_t elapsed_ns(const chrono::steady_clock::time_point &start) {
+  return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+}
+
+class StatsCollector {
+public:
+  void merge(const stats_t &s) {
+    std::lock_guard<std::mutex> lock(mtx);
+    total += s;
+  }
+
+  const stats_t &get() const { return total; }
+
+  /**
+   * Writes the counters, together with the figures of the index (Bloom
+   * filter size, bits set, stored ids) and the wall-clock time of the
+   * two phases, as a JSON object.
+   **/
+  bool write_json(const string &path, const uint64_t bf_size, const uint64_t bf_bits_set, const uint64_t index_ids,
+                  const size_t genes, const int threads, const double index_s, const double analysis_s) const {
+    FILE *out = fopen(path.c_str(), "w");
+    if (out == nullptr) return false;
+    const double per_s = analysis_s > 0 ? total.reads / analysis_s : 0;
+    fprintf(out, "{\n");
+    fprintf(out, "  \"threads\": %d,\n", threads);
+    fprintf(out, "  \"index\": {\n");
+    fprintf(out, "    \"genes\": %zu,\n", genes);
+    fprintf(out, "    \"reference_kmers\": %lu,\n", total.reference_kmers);
+    fprintf(out, "    \"bloom_bits\": %lu,\n", bf_size);
+    fprintf(out, "    \"bloom_bits_set\": %lu,\n", bf_bits_set);
+    fprintf(out, "    \"bloom_occupancy\": %.6g,\n", bf_size > 0 ? (double)bf_bits_set / bf_size : 0.0);
+    fprintf(out, "    \"ids\": %lu,\n", index_ids);
+    fprintf(out, "    \"seconds\": %.3f\n", index_s);
+    fprintf(out, "  },\n");
+    fprintf(out, "  \"analysis\": {\n");
+    fprintf(out, "    \"reads\": %lu,\n", total.reads);
+    fprintf(out, "    \"reads_accepted\": %lu,\n", total.reads_accepted);
+    fprintf(out, "    \"reads_rejected\": %lu,\n", total.reads - total.reads_accepted);
+    fprintf(out, "    \"associations\": %lu,\n", total.associations);
+    fprintf(out, "    \"kmer_lookups\": %lu,\n", total.kmer_lookups);
+    fprintf(out, "    \"bloom_hits\": %lu,\n", total.bloom_hits);
+    fprintf(out, "    \"empty_range_hits\": %lu,\n", total.empty_range_hits);
+    fprintf(out, "    \"ids_retrieved\": %lu,\n", total.ids_retrieved);
+    fprintf(out, "    \"kmer_cache_hits\": %lu,\n", total.kmer_cache_hits);
+    fprintf(out, "    \"kmer_cache_hit_rate\": %.6g,\n",
+            total.kmer_lookups > 0 ? (double)total.kmer_cache_hits / total.kmer_lookups : 0.0);
+    fprintf(out, "    \"read_cache_lookups\": %lu,\n", total.read_cache_lookups);
+    fprintf(out, "    \"read_cache_hits\": %lu,\n", total.read_cache_hits);
+    fprintf(out, "    \"read_cache_hit_rate\": %.6g,\n",
+            total.read_cache_lookups > 0 ? (double)total.read_cache_hits / total.read_cache_lookups : 0.0);
+    fprintf(out, "    \"splitter_seconds\": %.3f,\n", total.splitter_ns / 1e9);
+    fprintf(out, "    \"analyzer_seconds\": %.3f,\n", total.analysis_ns / 1e9);
+    fprintf(out, "    \"output_seconds\": %.3f,\n", total.output_ns / 1e9);
+    fprintf(out, "    \"seconds\": %.3f,\n", analysis_s);
+    fprintf(out, "    \"reads_per_second\": %.1f\n", per_s);
+    fprintf(out, "  }\n");
+    fprintf(out, "}\n");
+    return fclose(out) == 0;
+  }
+
+  /**
+   * Writes the gene counts as a table with a header line and a line
+   * per gene: name, reads associated only to the gene and reads
+   * associated to it and to other genes, separated by tabs.
+   **/
+  bool write_gene_counts(const string &path, const vector<string> &legend_ID) const {
+    FILE *out = path == "-" ? stdout : fopen(path.c_str(), "w");
+    if (out == nullptr) return false;
+    fprintf(out, "gene\tunique\tmulti\n");
+    for (size_t g = 0; g < legend_ID.size(); ++g) {
+      fprintf(out, "%s\t%lu\t%lu\n", legend_ID[g].c_str(),
+              g < total.gene_unique.size() ? total.gene_unique[g] : 0,
+              g < total.gene_multi.size() ? total.gene_multi[g] : 0);
+    }
+    return out == stdout ? fflush(out) == 0 : fclose(out) == 0;
+  }
+
+private:
+  stats_t total;
+  std::mutex mtx;
+};
+
+#endif
@@ -26,67 +26,139 @@
 #include <sstream>
 #include <getopt.h>
 
+#include "memory_utils.hpp"
+#include <string>
+#include <vector>
+
 static const char *USAGE_MESSAGE =
 "Usage: shark -r <references> -1 <sample1> [OPTIONAL ARGUMENTS]\n"
+"       shark -r <references> -m <manifest> [OPTIONAL ARGUMENTS]\n"
+"       shark serve -S <socket> -r <references> [-r <references> ...] [OPTIONAL ARGUMENTS]\n"
+"       shark submit -S <socket> -1 <sample1> [-i <index>] [OPTIONAL ARGUMENTS]\n"
+"       shark index -r <references> [-r <references> ...] -o <index> [OPTIONAL ARGUMENTS]\n"
 "\n"
 "Arguments:\n"
-"      -r, --reference                   reference sequences in FASTA format (can be gzipped)\n"
-"      -1, --sample1                     sample in FASTQ (can be gzipped)\n"
+"      -r, --reference                   reference sequences in FASTA format (can be gzipped), or an index saved by shark index\n"
+"      -1, --sample1                     sample in FASTQ (can be gzipped, - for stdin)\n"
+"      -m, --manifest                    batch of samples, one per line as: <sample1> <sample2> <out1> <out2> [<associations>]\n"
+"                                        (use - for missing second sample/output, associations default to stdout)\n"
 "\n"
 "Optional arguments:\n"
 "      -h, --help                        display this help and exit\n"
-"      -2, --sample2                     second sample in FASTQ (optional, can be gzipped)\n"
+"      -2, --sample2                     second sample in FASTQ (optional, can be gzipped, - for stdin)\n"
 "      -o, --out1                        first output sample in FASTQ (default: sharked_sample.1)\n"
 "      -p, --out2                        second output sample in FASTQ (default: sharked_sample.2)\n"
 "      -k, --kmer-size                   size of the kmers to index (default:17, max:31)\n"
 "      -c, --confidence                  confidence for associating a read to a gene (default:0.6)\n"
-"      -b, --bf-size                     bloom filter size in GB (default:1)\n"
+"      -b, --bf-size                     bloom filter size in GB (default: sized on the number of distinct k-mers, see -f)\n"
+"      -f, --bf-fpr                      target false positive rate of the bloom filter when -b is not given (default:0.005)\n"
 "      -q, --min-base-quality            minimum base quality (assume FASTQ Illumina 1.8+ Phred scale, default:0, i.e., no filtering)\n"
+"      -g, --gene-counts                 only count the reads associated to each gene and write the counts to this file (- for stdout),\n"
+"                                        instead of the associations and the filtered samples\n"
+"      -x, --stride                      look up only one k-mer out of this many in each read, for faster screening (default:1)\n"
+"      -w, --window                      classify long reads (ONT/PacBio) in windows of this many bases (at least k), associating them\n"
+"                                        to the genes of each window; paired mates are joined first (default: 0, reads are classified as a whole)\n"
 "      -s, --single                      report an association only if a single gene is found\n"
 "      -t, --threads                     number of threads (default:1)\n"
-"      -v, --verbose                     verbose mode\n";
+"      -H, --huge-pages                  back the index with huge pages: transparent or explicit (default: none)\n"
+"      -N, --numa                        interleave the index over the NUMA nodes and pin threads to them\n"
+"      -O, --offsets                     delimit the genes of each k-mer with an offset array: faster lookups, about log2(gene ids in the index) more bits per k-mer\n"
+"      -T, --tmp-dir                     build the index out of core, spilling sorted runs to this directory\n"
+"      -C, --read-cache                  size in MB of the cache of the verdicts of repeated read sequences, 0 to disable (default:16, at most 1/8 of the memory budget)\n"
+"      -K, --kmer-cache                  entries of the cache of k-mer lookups of each thread, 0 to disable (default:4096)\n"
+"      -M, --max-memory                  memory budget in GB: the bloom filter, the batches of reads and the io_uring buffers are fit into it (default: no limit)\n"
+"      -j, --stats                       write statistics of the run (counters and timings) to this file, in JSON\n"
+"      -v, --verbose                     verbose mode\n"
+"\n"
+"Server arguments:\n"
+"      -S, --socket                      Unix domain socket the server listens on (serve, submit)\n"
+"      -i, --index                       name (file name of the reference) of the index to use (submit, default: the only one served)\n"
+"\n"
+"Index arguments:\n"
+"      -o, --out1                        file the index is saved to: the indexes of the references are merged in order\n"
+"                                        (to add genes to a saved index, give it as the first reference)\n";
 
 namespace opt {
+  static std::string command = "";
   static std::string fasta_path = "";
+  static std::vector<std::string> fasta_paths;
+  static std::string socket_path = "";
+  static std::string index_name = "";
   static std::string sample1_path = "";
   static std::string sample2_path = "";
+  static std::string manifest_path = "";
   static std::string out1_path = "";
   static std::string out2_path = "";
+  static std::string stats_path = "";
+  static std::string counts_path = "";
+  static uint stride = 1;
+  static size_t window = 0; // bases, 0: whole reads
   static bool paired_flag = false;
   static uint k = 17;
   static double c = 0.6;
-  static uint64_t bf_size = ((uint64_t)0b1 << 33);
+  static uint64_t bf_size = 0; // 0: estimated from the reference
+  static double bf_fpr = 0.005;
   static char min_quality = 0;
   static bool single = false;
   static bool verbose = false;
   static int nThreads = 1;
+  static uint64_t max_memory = 0; // bytes, 0: no limit
+  static memory_policy::huge_pages_t huge_pages = memory_policy::NO_HUGE_PAGES;
+  static bool numa = false;
+  static std::string tmp_dir = "";
+  static bool offsets = false;
+  static uint64_t read_cache = (uint64_t)16 << 20; // bytes
+  static size_t kmer_cache = 4096; // entries (24 bytes each)
 }
 
-static const char *shortopts = "t:r:1:2:o:p:k:c:b:q:svh";
+static const char *shortopts = "t:r:1:2:m:o:p:k:c:b:f:q:M:H:NOT:C:K:S:i:j:g:x:w:svh";
 
 static const struct option longopts[] = {
   {"reference", required_argument, NULL, 'r'},
   {"threads", required_argument, NULL, 't'},
+  {"max-memory", required_argument, NULL, 'M'},
+  {"huge-pages", required_argument, NULL, 'H'},
+  {"numa", no_argument, NULL, 'N'},
+  {"offsets", no_argument, NULL, 'O'},
+  {"tmp-dir", required_argument, NULL, 'T'},
+  {"read-cache", required_argument, NULL, 'C'},
+  {"kmer-cache", required_argument, NULL, 'K'},
   {"sample1", required_argument, NULL, '1'},
   {"sample2", required_argument, NULL, '2'},
+  {"manifest", required_argument, NULL, 'm'},
   {"out1", required_argument, NULL, 'o'},
   {"out2", required_argument, NULL, 'p'},
   {"kmer-size", required_argument, NULL, 'k'},
   {"confidence", required_argument, NULL, 'c'},
   {"bf-size", required_argument, NULL, 'b'},
+  {"bf-fpr", required_argument, NULL, 'f'},
   {"min-base-quality", required_argument, NULL, 'q'},
   {"single", no_argument, NULL, 's'},
+  {"socket", required_argument, NULL, 'S'},
+  {"index", required_argument, NULL, 'i'},
+  {"stats", required_argument, NULL, 'j'},
+  {"gene-counts", required_argument, NULL, 'g'},
+  {"stride", required_argument, NULL, 'x'},
+  {"window", required_argument, NULL, 'w'},
   {"verbose", no_argument, NULL, 'v'},
   {"help", no_argument, NULL, 'h'},
   {NULL, 0, NULL, 0}
 };
 
 void parse_arguments(int argc, char **argv) {
+  if (argc > 1 && (std::string(argv[1]) == "serve" || std::string(argv[1]) == "submit" ||
+                   std::string(argv[1]) == "index")) {
+    opt::command = argv[1];
+    --argc;
+    ++argv;
+  }
+
   for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1; ) {
     std::istringstream arg(optarg != NULL ? optarg : "");
     switch (c) {
     case 'r':
       arg >> opt::fasta_path;
+      opt::fasta_paths.push_back(opt::fasta_path);
       break;
     case 't':
       arg >> opt::nThreads;
@@ -104,6 +176,9 @@ void parse_arguments(int argc, char **argv) {
       arg >> opt::sample2_path;
       opt::paired_flag = true;
       break;
+    case 'm':
+      arg >> opt::manifest_path;
+      break;
     case 'o':
       arg >> opt::out1_path;
       break;
@@ -131,7 +206,76 @@ void parse_arguments(int argc, char **argv) {
       // Let's consider this as GB
       arg >> opt::bf_size;
       opt::bf_size = opt::bf_size * ((uint64_t)0b1 << 33);
+      if(opt::bf_size == 0) {
+        std::cerr << "shark: the bloom filter size must be at least 1GB." << std::endl
+                  << "aborting..." << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'f':
+      arg >> opt::bf_fpr;
+      if(opt::bf_fpr <= 0 or opt::bf_fpr >= 1) {
+        std::cerr << "shark: the false positive rate must be in the range (0, 1)." << std::endl
+                  << "aborting..." << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'M': {
+      double gb = 0;
+      arg >> gb;
+      if(gb <= 0) {
+        std::cerr << "shark: the memory budget must be a positive number of GB." << std::endl
+                  << "aborting..." << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      opt::max_memory = static_cast<uint64_t>(gb * ((uint64_t)0b1 << 30));
       break;
+    }
+    case 'H': {
+      std::string mode;
+      arg >> mode;
+      if(mode == "transparent") {
+        opt::huge_pages = memory_policy::TRANSPARENT_HUGE_PAGES;
+      } else if(mode == "explicit") {
+        opt::huge_pages = memory_policy::EXPLICIT_HUGE_PAGES;
+      } else {
+        std::cerr << "shark: huge pages must be transparent or explicit." << std::endl
+                  << "aborting..." << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      break;
+    }
+    case 'N':
+      opt::numa = true;
+      break;
+    case 'O':
+      opt::offsets = true;
+      break;
+    case 'T':
+      arg >> opt::tmp_dir;
+      break;
+    case 'C': {
+      int mb = -1;
+      arg >> mb;
+      if(mb < 0) {
+        std::cerr << "shark: the read cache must be a non-negative number of MB." << std::endl
+                  << "aborting..." << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      opt::read_cache = static_cast<uint64_t>(mb) << 20;
+      break;
+    }
+    case 'K': {
+      int entries = -1;
+      arg >> entries;
+      if(entries < 0) {
+        std::cerr << "shark: the k-mer cache must have a non-negative number of entries." << std::endl
+                  << "aborting..." << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      opt::kmer_cache = entries;
+      break;
+    }
     case 'q':
       int mq;
       arg >> mq;
@@ -143,6 +287,40 @@ void parse_arguments(int argc, char **argv) {
       }
       opt::min_quality = static_cast<char>(mq);
       break;
+    case 'S':
+      arg >> opt::socket_path;
+      break;
+    case 'i':
+      arg >> opt::index_name;
+      break;
+    case 'j':
+      arg >> opt::stats_path;
+      break;
+    case 'g':
+      arg >> opt::counts_path;
+      break;
+    case 'x': {
+      int stride = 0;
+      arg >> stride;
+      if(stride <= 0) {
+        std::cerr << "shark: the stride must be a positive number of k-mers." << std::endl
+                  << "aborting..." << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      opt::stride = stride;
+      break;
+    }
+    case 'w': {
+      int window = -1;
+      arg >> window;
+      if(window < 0) {
+        std::cerr << "shark: the window must be a non-negative number of bases." << std::endl
+                  << "aborting..." << std::endl;
+        exit(EXIT_FAILURE);
+      }
+      opt::window = window;
+      break;
+    }
     case 's':
       opt::single = true;
       break;
@@ -159,12 +337,68 @@ void parse_arguments(int argc, char **argv) {
     }
   }
 
-  if (opt::fasta_path == "" || opt::sample1_path == "") {
+  if (opt::window > 0 && opt::window < opt::k) {
+    std::cerr << "shark: the window must be at least as long as the k-mers (" << opt::k << " bases)." << std::endl
+              << "aborting..." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  if (opt::command == "index") {
+    if (opt::fasta_paths.empty() || opt::out1_path == "" || opt::sample1_path != "" || opt::manifest_path != "") {
+      std::cerr << "shark: an index needs only the references and the file it is saved to (-o)." << std::endl
+                << "aborting..." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    return;
+  }
+
+  if (opt::command != "" && opt::socket_path == "") {
+    std::cerr << "shark : missing server socket" << std::endl;
+    std::cerr << "\n" << USAGE_MESSAGE;
+    exit(EXIT_FAILURE);
+  }
+
+  if (opt::command == "serve") {
+    if (opt::fasta_paths.empty() || opt::sample1_path != "" || opt::manifest_path != "") {
+      std::cerr << "shark: the server needs only the references, samples are submitted to it." << std::endl
+                << "aborting..." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    return;
+  }
+
+  if (opt::command == "submit") {
+    if (opt::fasta_path != "" || opt::manifest_path != "") {
+      std::cerr << "shark: submit one sample at a time, its reference is chosen with -i." << std::endl
+                << "aborting..." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if ((opt::fasta_path == "" && opt::command == "") || (opt::sample1_path == "" && opt::manifest_path == "")) {
     std::cerr << "shark : missing required files" << std::endl;
     std::cerr << "\n" << USAGE_MESSAGE;
     exit(EXIT_FAILURE);
   }
 
+  if (opt::counts_path != "") {
+    if (opt::command != "" || opt::manifest_path != "" || opt::out1_path != "" || opt::out2_path != "") {
+      std::cerr << "shark: gene counts are computed on a single sample, and no output sample is written." << std::endl
+                << "aborting..." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    return;
+  }
+
+  if (opt::manifest_path != "") {
+    if (opt::sample1_path != "" || opt::sample2_path != "" || opt::out1_path != "" || opt::out2_path != "") {
+      std::cerr << "shark: samples and outputs must be given in the manifest in batch mode." << std::endl
+                << "aborting..." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    return;
+  }
+
   if(opt::out1_path == "") {
     opt::out1_path = "sharked_sample.1";
   }
@@ -0,0 +1,279 @@
+/**
+ * shark - Mapping-free filtering of useless RNA-Seq reads
+ * Copyright (C) 2020 Tamara Ceccato, Luca Denti, Yuri Pirola, Marco Previtali
+ *
+ * This file is part of shark.
+ *
+ * shark is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shark is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shark; see the file LICENSE. If not, see
+ * <https://www.gnu.org/licenses/>.
+ **/
+
+/**
+ * Microbenchmarks of the hot kernels of shark, built from the same
+ * headers of the tool. Inputs are synthetic and generated with a fixed
+ * seed, so that runs are comparable across changes.
+ *
+ * Usage: bench [name]  (runs only the benchmarks whose name contains name)
+ **/
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+#include <zlib.h>
+
+#include "common.hpp"
+#include "bloomfilter.h"
+#include "KmerBuilder.hpp"
+#include "FastqParser.hpp"
+#include "FastqSplitter.hpp"
+#include "ReadAnalyzer.hpp"
+#include "kmer_utils.hpp"
+
+using namespace std;
+
+static const uint K = 17;
+static const int NGENES = 200;
+static const int GENE_LEN = 2000;
+static const int NREADS = 20000;
+static const int READ_LEN = 100;
+static const uint64_t BF_SIZE = (uint64_t)1 << 26;
+static const size_t KMER_CACHE_SIZE = 4096; // default of -K
+
+static mt19937_64 rng(42);
+
+// Keeps the compiler from optimizing away the benchmarked code
+static volatile uint64_t sink;
+
+string random_seq(const size_t len) {
+  static const char bases[] = "ACGT";
+  string s(len, 'A');
+  for (auto &c : s) c = bases[rng() & 3];
+  return s;
+}
+
+// Indexes the k-mers of the genes, the i-th gene having id i
+void build_index(BF &bloom, KmerBuilder &kb, const vector<string> &genes) {
+  {
+    vector<uint64_t> *hashes = kb(new vector<pair<string, string>>(
+      [&] { vector<pair<string, string>> v; for (const auto &g : genes) v.emplace_back("", g); return v; }()));
+    for (const auto h : *hashes) bloom.add_at(h);
+    delete hashes;
+  }
+  bloom.switch_mode(1);
+  for (size_t i = 0; i < genes.size(); ++i) {
+    vector<uint64_t> kmers;
+    int p = 0;
+    uint64_t kmer = build_kmer(genes[i], p, K);
+    kmers.push_back(min(kmer, revcompl(kmer, K)));
+    for (; p < (int)genes[i].size(); ++p) {
+      kmer = lsappend(kmer, to_int[genes[i][p]] - 1, K);
+      kmers.push_back(min(kmer, revcompl(kmer, K)));
+    }
+    bloom.add_to_kmer(kmers, i);
+  }
+  bloom.switch_mode(2);
+}
+
+bool selected(const string &filter, const string &name) {
+  return name.find(filter) != string::npos;
+}
+
+/**
+ * Runs f (which processes ops items) until at least half a second has
+ * elapsed, then reports the time per item.
+ **/
+template <typename F>
+void run(const string &filter, const string &name, const uint64_t ops, F f) {
+  if (!selected(filter, name)) return;
+  f(); // warm-up
+  uint64_t iters = 0;
+  auto start = chrono::high_resolution_clock::now();
+  double elapsed = 0;
+  do {
+    f();
+    ++iters;
+    elapsed = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+  } while (elapsed < 0.5);
+  const double ns = elapsed * 1e9 / (iters * ops);
+  printf("%-34s %10lu %12.2f %12.2f\n", name.c_str(), iters * ops, ns, 1e3 / ns);
+}
+
+int main(int argc, char *argv[]) {
+  const string filter = argc > 1 ? argv[1] : "";
+
+  /*** Synthetic reference, index, and sample ********************************/
+  vector<string> genes;
+  vector<string> legend_ID;
+  for (int i = 0; i < NGENES; ++i) {
+    genes.push_back(random_seq(GENE_LEN));
+    legend_ID.push_back("gene" + to_string(i));
+  }
+
+  BF bloom(BF_SIZE);
+  KmerBuilder kb(K);
+  build_index(bloom, kb, genes);
+
+  // Half of the reads come from the reference (with a few errors), half are random
+  vector<elem_t> reads;
+  for (int i = 0; i < NREADS; ++i) {
+    string seq;
+    if (i % 2 == 0) {
+      seq = genes[rng() % NGENES].substr(rng() % (GENE_LEN - READ_LEN), READ_LEN);
+      for (int e = 0; e < 2; ++e) seq[rng() % READ_LEN] = "ACGT"[rng() & 3];
+    } else {
+      seq = random_seq(READ_LEN);
+    }
+    reads.push_back({ seq, { { "read" + to_string(i), "", "" }, {} } });
+  }
+
+  vector<uint64_t> query_kmers;
+  for (const auto &r : reads) {
+    int p = 0;
+    query_kmers.push_back(build_kmer(r.first, p, K));
+  }
+
+  printf("%-34s %10s %12s %12s\n", "benchmark", "items", "ns/item", "Mitems/s");
+
+  /*** k-mer extraction ******************************************************/
+  run(filter, "build_kmer", reads.size(), [&] {
+    for (const auto &r : reads) {
+      int p = 0;
+      sink += build_kmer(r.first, p, K);
+    }
+  });
+
+  run(filter, "rolling_kmers", NGENES * (GENE_LEN - K + 1), [&] {
+    for (const auto &g : genes) {
+      int p = 0;
+      uint64_t kmer = build_kmer(g, p, K);
+      uint64_t rckmer = revcompl(kmer, K);
+      for (; p < (int)g.size(); ++p) {
+        const uint8_t c = to_int[g[p]] - 1;
+        kmer = lsappend(kmer, c, K);
+        rckmer = rsprepend(rckmer, reverse_char(c), K);
+        sink += min(kmer, rckmer);
+      }
+    }
+  });
+
+  run(filter, "KmerBuilder", NGENES * (GENE_LEN - K + 1), [&] {
+    vector<pair<string, string>> *texts = new vector<pair<string, string>>();
+    for (const auto &g : genes) texts->emplace_back("", g);
+    vector<uint64_t> *hashes = kb(texts);
+    sink += hashes->size();
+    delete hashes;
+  });
+
+  /*** Hashing and lookups ***************************************************/
+  run(filter, "_get_hash", query_kmers.size(), [&] {
+    for (const auto kmer : query_kmers) sink += _get_hash(kmer);
+  });
+
+  run(filter, "BF::get_index", query_kmers.size(), [&] {
+    for (const auto kmer : query_kmers) {
+      auto range = bloom.get_index(kmer);
+      sink += range.second - range.first;
+    }
+  });
+
+  /*** Read analysis *********************************************************/
+  ReadAnalyzer ra(&bloom, legend_ID, K, 0.6, false);
+  stats_t stats;
+  run(filter, "ReadAnalyzer", reads.size(), [&] {
+    ReadAnalyzer::output_t associations;
+    ra(reads, associations, stats);
+    sink += associations.size();
+  });
+
+  ReadAnalyzer ra_kc(&bloom, legend_ID, K, 0.6, false, 0, KMER_CACHE_SIZE);
+  run(filter, "ReadAnalyzer/kmer-cache", reads.size(), [&] {
+    ReadAnalyzer::output_t associations;
+    ra_kc(reads, associations, stats);
+    sink += associations.size();
+  });
+
+  /*** Offset array ***********************************************************/
+  bloom.build_offsets();
+  run(filter, "BF::get_index/offsets", query_kmers.size(), [&] {
+    for (const auto kmer : query_kmers) {
+      auto range = bloom.get_index(kmer);
+      sink += range.second - range.first;
+    }
+  });
+
+  run(filter, "ReadAnalyzer/offsets", reads.size(), [&] {
+    ReadAnalyzer::output_t associations;
+    ra(reads, associations, stats);
+    sink += associations.size();
+  });
+
+  /*** Prefilter, on a filter larger than the last-level cache ***************/
+  if (selected(filter, "BF::get_index/large") || selected(filter, "ReadAnalyzer/large")) {
+    uint64_t large_size = BF_SIZE;
+    while (large_size / 8 <= last_level_cache_bytes()) large_size <<= 1;
+    BF large(large_size);
+    build_index(large, kb, genes);
+    ReadAnalyzer ra_large(&large, legend_ID, K, 0.6, false);
+    for (const bool prefilter : { true, false }) {
+      large.use_prefilter(prefilter);
+      const string variant = prefilter ? "" : "/no-prefilter";
+      run(filter, "BF::get_index/large" + variant, query_kmers.size(), [&] {
+        for (const auto kmer : query_kmers) {
+          auto range = large.get_index(kmer);
+          sink += range.second - range.first;
+        }
+      });
+      run(filter, "ReadAnalyzer/large" + variant, reads.size(), [&] {
+        ReadAnalyzer::output_t associations;
+        ra_large(reads, associations, stats);
+        sink += associations.size();
+      });
+    }
+  }
+
+  /*** FASTQ parsing *********************************************************/
+  char fq_path[] = "/tmp/shark_bench_XXXXXX";
+  const int fd = mkstemp(fq_path);
+  if (fd < 0) {
+    cerr << "bench: cannot create a temporary file" << endl;
+    return 1;
+  }
+  FILE *fq = fdopen(fd, "w");
+  for (const auto &r : reads)
+    fprintf(fq, "@%s\n%s\n+\n%s\n", r.second.first.id.c_str(), r.first.c_str(), string(READ_LEN, 'I').c_str());
+  fclose(fq);
+
+  for (const char min_quality : { 0, 20 }) {
+    run(filter, "FastqSplitter/q" + to_string(min_quality), reads.size(), [&] {
+      gzFile in = gzopen(fq_path, "r");
+      FastqParser fq(in);
+      FastqSplitter fs(&fq, nullptr, 50000, min_quality, true);
+      FastqSplitter::output_t batch;
+      do {
+        batch.clear();
+        fs(batch);
+        sink += batch.size();
+      } while (!batch.empty());
+      gzclose(in);
+    });
+  }
+  unlink(fq_path);
+
+  return 0;
+}
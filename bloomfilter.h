@@ -23,11 +23,16 @@
 #define _BLOOM_FILTER_HPP
 
 #include <algorithm>
+#include <iostream>
+#include <memory>
 #include <sdsl/bit_vectors.hpp>
 #include <sdsl/util.hpp>
 #include <string>
 
+#include "ExternalSorter.hpp"
+#include "InterleavedBitVector.hpp"
 #include "kmer_utils.hpp"
+#include "memory_utils.hpp"
 #include "small_vector.hpp"
 
 using namespace std;
@@ -39,23 +44,55 @@ public:
   typedef uint64_t kmer_t;
   typedef uint64_t hash_t;
   typedef sdsl::bit_vector bit_vector_t;
-  typedef bit_vector_t::rank_1_type rank_t;
   typedef small_vector_t index_t;
-  typedef vector<index_t> set_index_t;
-  typedef vector<uint16_t> index_kmer_t;
+  typedef vector<index_t, policy_allocator<index_t>> set_index_t;
+  typedef vector<uint16_t, policy_allocator<uint16_t>> index_kmer_t;
   typedef bit_vector_t::select_1_type select_t;
+  typedef sdsl::int_vector<> offsets_t;
 
   BF(const size_t size) :
     _size(size),
     _mode(0),
-    _bf(size, 0)
-  {
-  }
+    _bf(size),
+    _prefilter_log_bits(16)
+  {}
 
   ~BF() {}
 
+  // Number of bits of the filter
+  size_t size() const {
+    return _size;
+  }
+
+  // Number of bits set in the filter (available from mode 1)
+  size_t bits_set() const {
+    return _mode == 0 ? 0 : _bf.rank(_size);
+  }
+
+  // Number of ids stored in the index (available in mode 2)
+  size_t ids() const {
+    return _index_kmer.size();
+  }
+
   void add_at(const uint64_t p) {
-    _bf[p % _size] = 1;
+    _bf.set(p % _size);
+  }
+
+  // Same as add_at, but safe when called concurrently
+  void add_at_concurrent(const uint64_t p) {
+    _bf.set_concurrent(p % _size);
+  }
+
+  /**
+   * Builds the index out of core: instead of keeping the set of idxs
+   * of each k-mer in memory during mode 1, (k-mer rank, idx) pairs are
+   * spilled to sorted runs of run_size pairs in tmp_dir and merged
+   * into the final structures in switch_mode(2). Must be called in
+   * mode 0.
+   **/
+  void use_external_memory(const string &tmp_dir, const size_t run_size) {
+    if (_mode == 0)
+      _runs.reset(new ExternalSorter(tmp_dir, run_size));
   }
 
   void add_to_kmer(vector<uint64_t> &kmers, const int input_idx) {
@@ -66,19 +103,36 @@ public:
       kmer = _get_hash(kmer) % _size;
     }
     sort(kmers.begin(), kmers.end());
+    if (_runs) {
+      // pairs are packed as rank << 16 | idx, so that they sort by rank, then by idx
+      kmers.erase(unique(kmers.begin(), kmers.end()), kmers.end());
+      for (auto& kmer: kmers) {
+        kmer = (_bf.rank(kmer) << 16) | static_cast<uint16_t>(input_idx);
+      }
+      _runs->add(kmers);
+      return;
+    }
     for (const auto bf_idx: kmers) {
-      int kmer_rank = _brank(bf_idx);
+      int kmer_rank = _bf.rank(bf_idx);
       const auto size = _set_index[kmer_rank].size();
       if (size == 0 || _set_index[kmer_rank].last() != input_idx)
-        _set_index[kmer_rank].push_back(input_idx);
+        _set_index[kmer_rank].push_back(input_idx, _arena);
     }
   }
 
   // Function that returns the indexes of a given k-mer
   pair<index_kmer_t::const_iterator, index_kmer_t::const_iterator> get_index(const kmer_t &kmer) const {
+    bool in_filter;
+    return get_index(kmer, in_filter);
+  }
+
+  // Same, also telling whether the k-mer is in the filter (its set of indexes can still be empty)
+  pair<index_kmer_t::const_iterator, index_kmer_t::const_iterator> get_index(const kmer_t &kmer,
+                                                                             bool &in_filter) const {
     int start_pos = 0;
     int end_pos = -1; // in this way, if the kmer is not in the bf, the returned IDView has no next
 
+    in_filter = false;
     #ifndef NDEBUG
     if (_mode != 2)
       return make_pair(_index_kmer.end(), _index_kmer.end());
@@ -86,12 +140,19 @@ public:
 
     uint64_t hash = _get_hash(kmer);
     size_t bf_idx = hash % _size;
-    if (_bf[bf_idx]) {
-      size_t rank_searched = _brank(bf_idx + 1);
-      if (rank_searched > 1) { // idxs of the first kmer
-        start_pos = _select_bv(rank_searched - 1) + 1;
+    // the value and the rank of the bit are read from the same cache line
+    size_t rank_searched;
+    if ((_prefilter.empty() || _in_prefilter(bf_idx)) && (rank_searched = _bf.rank_if_set(bf_idx)) != 0) {
+      in_filter = true;
+      if (!_offsets.empty()) { // the set is delimited by two adjacent offsets
+        start_pos = _offsets[rank_searched - 1];
+        end_pos = _offsets[rank_searched] - 1;
+      } else {
+        if (rank_searched > 1) { // idxs of the first kmer
+          start_pos = _select_bv(rank_searched - 1) + 1;
+        }
+        end_pos = _select_bv(rank_searched);
       }
-      end_pos = _select_bv(rank_searched);
       // FIXME if a k-mer has no indexes the function returns a vector with
       // only one 0
       // FIXME how to handle this situation? is the main that has to manage
@@ -118,11 +179,16 @@ public:
        * function.
        **/
       _mode = new_mode;
-      sdsl::util::init_support(_brank,&_bf);
-      size_t num_kmer = _brank(_bf.size());
-      if (num_kmer != 0)
+      _bf.init_rank();
+      _build_prefilter();
+      size_t num_kmer = _bf.rank(_bf.size());
+      if (num_kmer != 0 && !_runs)
         _set_index.resize(num_kmer, index_t());
       return true;
+    } else if(_mode == 1 and new_mode == 2 and _runs) {
+      _mode = new_mode;
+      _merge_runs();
+      return true;
     } else if(_mode == 1 and new_mode == 2) {
       _mode = new_mode;
 
@@ -181,25 +247,236 @@ public:
 
       // FIXME: is this the best way to release _set_index?
       set_index_t().swap(_set_index);
+      _arena.clear();
       return true;
     } else {
       return false;
     }
   }
 
+  /**
+   * Alternative layout of the sets of idxs (mode 2 only): the offset
+   * of the end of each set is stored, bit-packed, at the rank of its
+   * k-mer, so that get_index finds a set with a rank and two adjacent
+   * reads instead of a rank and two selects on _bv. It takes
+   * log2(ids()) bits per k-mer; the select support is then released.
+   **/
+  bool build_offsets() {
+    if (_mode != 2)
+      return false;
+    const size_t num_kmer = _bf.rank(_size);
+    const uint64_t tot_idx = _index_kmer.size();
+    _offsets = offsets_t(num_kmer + 1, 0, 64 - __builtin_clzll(tot_idx | 1));
+    size_t rank = 0;
+    const size_t words = (tot_idx + 63) / 64;
+    for (size_t w = 0; w < words; ++w) {
+      for (uint64_t word = _bv.data()[w]; word != 0; word &= word - 1)
+        _offsets[++rank] = w * 64 + __builtin_ctzll(word) + 1;
+    }
+    apply_memory_policy(_offsets.data(), (_offsets.bit_size() + 7) / 8);
+    sdsl::util::clear(_select_bv);
+    return true;
+  }
+
+  /**
+   * Builds the prefilter (from mode 1 on), even if the filter fits in
+   * the last-level cache, or drops it, e.g. to compare lookups with and
+   * without it.
+   **/
+  void use_prefilter(const bool use) {
+    vector<uint64_t>().swap(_prefilter);
+    if (use && _mode != 0)
+      _fill_prefilter();
+  }
+
+  /**
+   * Writes the index (mode 2 only) to out: size of the filter, filter,
+   * bit vector delimiting the sets of idxs and the idxs. Rank and
+   * select supports are rebuilt by load.
+   **/
+  bool serialize(ostream &out) const {
+    if (_mode != 2)
+      return false;
+    const uint64_t size = _size, nidx = _index_kmer.size();
+    out.write(reinterpret_cast<const char *>(&size), sizeof(size));
+    _bf.serialize(out);
+    _bv.serialize(out);
+    out.write(reinterpret_cast<const char *>(&nidx), sizeof(nidx));
+    out.write(reinterpret_cast<const char *>(_index_kmer.data()), nidx * sizeof(uint16_t));
+    return out.good();
+  }
+
+  // Reads an index written by serialize, nullptr on failure
+  static BF *load(istream &in) {
+    uint64_t size = 0, nidx = 0;
+    if (!in.read(reinterpret_cast<char *>(&size), sizeof(size)) || size == 0)
+      return nullptr;
+    unique_ptr<BF> index(new BF(size));
+    if (!index->_bf.load(in))
+      return nullptr;
+    index->_bv.load(in);
+    in.read(reinterpret_cast<char *>(&nidx), sizeof(nidx));
+    if (!in || index->_bv.size() != nidx)
+      return nullptr;
+    index->_index_kmer.resize(nidx);
+    if (!in.read(reinterpret_cast<char *>(index->_index_kmer.data()), nidx * sizeof(uint16_t)))
+      return nullptr;
+    index->_mode = 2;
+    index->_build_prefilter();
+    sdsl::util::init_support(index->_select_bv, &index->_bv);
+    return index.release();
+  }
+
+  /**
+   * Merges two indexes (mode 2) with filters of the same size, built on
+   * disjoint sets of transcripts: the filters are or-ed and, for each
+   * k-mer, the idxs of b (shifted by offset, the number of transcripts
+   * of a) follow those of a. Returns nullptr if the sizes differ.
+   **/
+  static BF *merge(const BF &a, const BF &b, const uint16_t offset) {
+    if (a._size != b._size || a._mode != 2 || b._mode != 2)
+      return nullptr;
+    BF *const index = new BF(a._size);
+    const size_t words = index->_bf.words();
+    for (size_t w = 0; w < words; ++w)
+      index->_bf.set_word(w, a._bf.word(w) | b._bf.word(w));
+    index->_bf.init_rank();
+    index->_build_prefilter();
+
+    const size_t tot_idx = a._index_kmer.size() + b._index_kmer.size();
+    index->_bv = bit_vector_t(tot_idx, 0);
+    index->_index_kmer.resize(tot_idx);
+    index_kmer_t::iterator ins = index->_index_kmer.begin();
+    size_t ra = 0, rb = 0; // k-mers of a and b seen so far
+    for (size_t w = 0; w < words; ++w) {
+      for (uint64_t word = index->_bf.word(w); word != 0; word &= word - 1) {
+        const size_t pos = w * 64 + __builtin_ctzll(word);
+        if (a._bf[pos])
+          ins = a._copy_set(++ra, ins, 0);
+        if (b._bf[pos])
+          ins = b._copy_set(++rb, ins, offset);
+        index->_bv[ins - index->_index_kmer.begin() - 1] = 1;
+      }
+    }
+    index->_mode = 2;
+    sdsl::util::init_support(index->_select_bv, &index->_bv);
+    return index;
+  }
+
 private:
+  /**
+   * Builds _bv and _index_kmer from the sorted (rank, idx) pairs: as
+   * each block of pairs comes from a single input and is deduplicated,
+   * the number of idxs to store is the number of pairs.
+   **/
+  void _merge_runs() {
+    const size_t tot_idx = _runs->size();
+    _bv = bit_vector_t(tot_idx, 0);
+    _index_kmer.resize(tot_idx);
+    size_t pos = 0;
+    uint64_t pair, prev_rank = 0;
+    while (_runs->next(pair)) {
+      const uint64_t rank = pair >> 16;
+      if (pos > 0 && rank != prev_rank)
+        _bv[pos - 1] = 1;
+      _index_kmer[pos++] = pair & 0xFFFF;
+      prev_rank = rank;
+    }
+    if (pos != tot_idx) {
+      cerr << "shark: the sorted runs of the index are incomplete (" << pos << " of " << tot_idx << " pairs)." << endl
+           << "aborting..." << endl;
+      exit(EXIT_FAILURE);
+    }
+    if (pos > 0)
+      _bv[pos - 1] = 1;
+    _runs.reset();
+    sdsl::util::init_support(_select_bv,&_bv);
+  }
+
+  /**
+   * A filter that does not fit in the last-level cache is not cache
+   * resident: we build a small prefilter with a bit for each bit set in
+   * _bf, at a position given by a multiplicative hash of it, so that
+   * most of the k-mers that are not in the filter are rejected without
+   * touching it. It takes about PREFILTER_BITS_PER_KMER bits per bit set
+   * in _bf (a power of two, at least 2^16), but no more than a quarter
+   * of the last-level cache. As it only depends on _bf, it is built
+   * when the filter is complete (from mode 1 on, after load and merge).
+   * It is kept while at most half of its bits are set, i.e. up to about
+   * 0.7 bits set in _bf per bit of the prefilter: with a 32MB cache,
+   * up to about 45M k-mers.
+   **/
+  void _build_prefilter() {
+    if (_bf.bytes() > last_level_cache_bytes())
+      _fill_prefilter();
+  }
+
+  void _fill_prefilter() {
+    const uint64_t ones = _bf.rank(_bf.size());
+    const uint64_t max_bits = max<uint64_t>(last_level_cache_bytes() / 4 * 8, 1 << 16);
+    _prefilter_log_bits = 16;
+    while (((uint64_t)1 << _prefilter_log_bits) < ones * PREFILTER_BITS_PER_KMER
+           && ((uint64_t)2 << _prefilter_log_bits) <= max_bits)
+      ++_prefilter_log_bits;
+    const uint64_t bits = (uint64_t)1 << _prefilter_log_bits;
+    _prefilter.assign(bits / 64, 0);
+    const size_t words = _bf.words();
+    for (size_t w = 0; w < words; ++w) {
+      for (uint64_t word = _bf.word(w); word != 0; word &= word - 1) {
+        const uint64_t i = _prefilter_idx(w * 64 + __builtin_ctzll(word));
+        _prefilter[i >> 6] |= static_cast<uint64_t>(1) << (i & 63);
+      }
+    }
+    uint64_t set = 0;
+    for (const auto word : _prefilter)
+      set += __builtin_popcountll(word);
+    if (set > bits / 2)
+      vector<uint64_t>().swap(_prefilter);
+  }
+
+  uint64_t _prefilter_idx(const uint64_t bf_idx) const {
+    return (bf_idx * 0x9E3779B97F4A7C15ULL) >> (64 - _prefilter_log_bits);
+  }
+
+  bool _in_prefilter(const uint64_t bf_idx) const {
+    const uint64_t i = _prefilter_idx(bf_idx);
+    return (_prefilter[i >> 6] >> (i & 63)) & 1;
+  }
+
+  // Copies the idxs of the rank-th k-mer (from 1) to out, adding offset
+  index_kmer_t::iterator _copy_set(const size_t rank, index_kmer_t::iterator out, const uint16_t offset) const {
+    size_t start_pos, end_pos;
+    if (!_offsets.empty()) {
+      start_pos = _offsets[rank - 1];
+      end_pos = _offsets[rank] - 1;
+    } else {
+      start_pos = rank > 1 ? _select_bv(rank - 1) + 1 : 0;
+      end_pos = _select_bv(rank);
+    }
+    for (size_t i = start_pos; i <= end_pos; ++i)
+      *out++ = _index_kmer[i] + offset;
+    return out;
+  }
+
   BF() = delete;
   const BF &operator=(const BF &) = delete;
   const BF &operator=(const BF &&) = delete;
 
   const size_t _size;
   int _mode;
-  bit_vector_t _bf;
-  rank_t _brank;
+  InterleavedBitVector _bf; // bits and rank
   bit_vector_t _bv;
   set_index_t _set_index;
+  small_vector_arena_t _arena; // overflow lists of _set_index
   index_kmer_t _index_kmer;
   select_t _select_bv;
+  offsets_t _offsets; // empty if the sets are delimited by _select_bv
+  unique_ptr<ExternalSorter> _runs;
+  vector<uint64_t> _prefilter; // empty if not used
+  int _prefilter_log_bits;
+
+  // about an eighth of the prefilter set, to stay resident in the cache
+  static const uint64_t PREFILTER_BITS_PER_KMER = 8;
 };
 
 #endif
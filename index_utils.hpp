@@ -0,0 +1,141 @@
+/**
+ * shark - Mapping-free filtering of useless RNA-Seq reads
+ * Copyright (C) 2020 Tamara Ceccato, Luca Denti, Yuri Pirola, Marco Previtali
+ *
+ * This file is part of shark.
+ *
+ * shark is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shark is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shark; see the file LICENSE. If not, see
+ * <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef _INDEX_UTILS_HPP
+#define _INDEX_UTILS_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "bloomfilter.h"
+
+using namespace std;
+
+/**
+ * A saved index is a header (magic, version, k, size of the filter,
+ * number of idxs, names of the transcripts) followed by the BF, as
+ * written by BF::serialize. The header alone is enough to plan a run.
+ **/
+namespace index_file {
+  const char MAGIC[8] = { 'S', 'H', 'A', 'R', 'K', 'I', 'D', 'X' };
+  const uint32_t VERSION = 1;
+}
+
+struct index_header_t {
+  uint32_t k;
+  uint64_t bf_size;
+  uint64_t ids;
+  vector<string> legend_ID;
+};
+
+template <typename T> bool read_pod(istream &in, T &x) {
+  return static_cast<bool>(in.read(reinterpret_cast<char *>(&x), sizeof(T)));
+}
+
+template <typename T> void write_pod(ostream &out, const T &x) {
+  out.write(reinterpret_cast<const char *>(&x), sizeof(T));
+}
+
+// True if path starts with the magic of a saved index
+bool is_index(const string &path) {
+  ifstream in(path, ios::binary);
+  char magic[sizeof(index_file::MAGIC)];
+  return in.read(magic, sizeof(magic)) && memcmp(magic, index_file::MAGIC, sizeof(magic)) == 0;
+}
+
+bool read_index_header(istream &in, index_header_t &header) {
+  char magic[sizeof(index_file::MAGIC)];
+  uint32_t version = 0;
+  uint64_t ngenes = 0;
+  if (!in.read(magic, sizeof(magic)) || memcmp(magic, index_file::MAGIC, sizeof(magic)) != 0 ||
+      !read_pod(in, version) || version != index_file::VERSION || !read_pod(in, header.k) ||
+      !read_pod(in, header.bf_size) || !read_pod(in, header.ids) || !read_pod(in, ngenes))
+    return false;
+  header.legend_ID.clear();
+  for (uint64_t i = 0; i < ngenes; ++i) {
+    uint32_t len = 0;
+    if (!read_pod(in, len))
+      return false;
+    string name(len, '\0');
+    if (!in.read(&name[0], len))
+      return false;
+    header.legend_ID.push_back(name);
+  }
+  return true;
+}
+
+bool try_read_index_header(const string &path, index_header_t &header, string &error) {
+  ifstream in(path, ios::binary);
+  if (!in) {
+    error = "cannot open " + path;
+    return false;
+  }
+  if (!read_index_header(in, header)) {
+    error = path + " is not a valid index";
+    return false;
+  }
+  return true;
+}
+
+// Loads the index saved in path, nullptr on failure (error is set)
+BF *try_load_index(const string &path, index_header_t &header, string &error) {
+  ifstream in(path, ios::binary);
+  if (!in) {
+    error = "cannot open " + path;
+    return nullptr;
+  }
+  BF *index = read_index_header(in, header) ? BF::load(in) : nullptr;
+  if (index == nullptr || index->size() != header.bf_size) {
+    delete index;
+    error = path + " is not a valid index";
+    return nullptr;
+  }
+  return index;
+}
+
+bool try_save_index(const string &path, const uint32_t k, const vector<string> &legend_ID, const BF &index,
+                    string &error) {
+  ofstream out(path, ios::binary);
+  if (!out) {
+    error = "cannot write " + path;
+    return false;
+  }
+  out.write(index_file::MAGIC, sizeof(index_file::MAGIC));
+  write_pod(out, index_file::VERSION);
+  write_pod(out, k);
+  write_pod(out, static_cast<uint64_t>(index.size()));
+  write_pod(out, static_cast<uint64_t>(index.ids()));
+  write_pod(out, static_cast<uint64_t>(legend_ID.size()));
+  for (const auto &name : legend_ID) {
+    write_pod(out, static_cast<uint32_t>(name.size()));
+    out.write(name.data(), name.size());
+  }
+  if (!index.serialize(out) || !out.flush()) {
+    error = "cannot write " + path;
+    return false;
+  }
+  return true;
+}
+
+#endif
@@ -0,0 +1,145 @@
+/**
+ * shark - Mapping-free filtering of useless RNA-Seq reads
+ * Copyright (C) 2020 Tamara Ceccato, Luca Denti, Yuri Pirola, Marco Previtali
+ *
+ * This file is part of shark.
+ *
+ * shark is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shark is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shark; see the file LICENSE. If not, see
+ * <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef _IO_UTILS_HPP
+#define _IO_UTILS_HPP
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "AsyncIO.hpp"
+#include "FastqParser.hpp"
+
+using namespace std;
+
+inline string input_name(const string &path) {
+  return path == "-" ? "standard input" : path;
+}
+
+inline string format_error(const string &path, const string &headers) {
+  return input_name(path) + " is not in " + (headers == ">" ? "FASTA" : "FASTQ or FASTA") + " format";
+}
+
+/**
+ * Opens an input for reading. "-" stands for the standard input, any
+ * other path is opened as is (regular files as well as named pipes).
+ * Since pipes cannot be reopened, the input is checked on the same
+ * stream that will be read afterwards: we peek its first character,
+ * which must be one of headers (">" for FASTA, "@>" for samples, which
+ * may be FASTQ or FASTA), and push it back. On failure, nullptr is
+ * returned and error is set.
+ **/
+gzFile try_open_input(const string &path, const string &headers, string &error) {
+  gzFile file = path == "-" ? gzdopen(dup(STDIN_FILENO), "r") : gzopen(path.c_str(), "r");
+  if (file == nullptr) {
+    error = "cannot open " + input_name(path);
+    return nullptr;
+  }
+  const int c = gzgetc(file);
+  if (c != -1) {
+    if (headers.find(static_cast<char>(c)) == string::npos) {
+      error = format_error(path, headers);
+      gzclose(file);
+      return nullptr;
+    }
+    gzungetc(c, file);
+  }
+  return file;
+}
+
+/**
+ * Opens a sample (FASTQ or FASTA), checked as by try_open_input, and
+ * returns its parser, which closes it when deleted. With io_uring, a
+ * regular file is read through an AsyncReader only; anything else is
+ * read with zlib. On failure, nullptr is returned and error is set.
+ **/
+FastqParser *try_open_sample(const string &path, string &error) {
+#ifdef SHARK_IO_URING
+  shared_ptr<AsyncReader> reader(AsyncReader::open(path));
+  if (reader) {
+    const int c = reader->peek();
+    if (c != -1 && c != '@' && c != '>') {
+      error = format_error(path, "@>");
+      return nullptr;
+    }
+    return new FastqParser([reader](char *buf, const unsigned len) { return reader->read(buf, len); });
+  }
+#endif
+  gzFile const file = try_open_input(path, "@>", error);
+  if (file == nullptr)
+    return nullptr;
+  shared_ptr<gzFile_s> in(file, gzclose);
+  return new FastqParser([in](char *buf, const unsigned len) { return FastqParser::gz_read(in.get(), buf, len); });
+}
+
+// With io_uring, regular files are written asynchronously
+FILE *try_open_output(const string &path, string &error) {
+#ifdef SHARK_IO_URING
+  FILE *file = AsyncWriter::open(path);
+  if (file == nullptr)
+    file = fopen(path.c_str(), "w");
+#else
+  FILE *file = fopen(path.c_str(), "w");
+#endif
+  if (file == nullptr)
+    error = "cannot write " + path;
+  return file;
+}
+
+gzFile open_input(const string &path, const string &headers) {
+  string error;
+  gzFile file = try_open_input(path, headers, error);
+  if (file == nullptr) {
+    cerr << "shark: " << error << "." << endl
+         << "aborting..." << endl;
+    exit(EXIT_FAILURE);
+  }
+  return file;
+}
+
+FastqParser *open_sample(const string &path) {
+  string error;
+  FastqParser *const fq = try_open_sample(path, error);
+  if (fq == nullptr) {
+    cerr << "shark: " << error << "." << endl
+         << "aborting..." << endl;
+    exit(EXIT_FAILURE);
+  }
+  return fq;
+}
+
+FILE *open_output(const string &path) {
+  string error;
+  FILE *file = try_open_output(path, error);
+  if (file == nullptr) {
+    cerr << "shark: " << error << "." << endl
+         << "aborting..." << endl;
+    exit(EXIT_FAILURE);
+  }
+  return file;
+}
+
+#endif
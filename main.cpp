@@ -25,8 +25,11 @@
 #include <string>
 #include <vector>
 #include <thread>
+#include <atomic>
 
 #include <zlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "kseq.h"
 KSEQ_INIT(gzFile, gzread)
@@ -38,14 +41,25 @@ KSEQ_INIT(gzFile, gzread)
 #include "KmerBuilder.hpp"
 #include "FastaSplitter.hpp"
 #include "FastqSplitter.hpp"
+#include "HyperLogLog.hpp"
+#include "MappedFasta.hpp"
+#include "MemoryPlan.hpp"
 #include "ReadAnalyzer.hpp"
 #include "ReadOutput.hpp"
+#include "SampleJob.hpp"
+#include "Server.hpp"
+#include "Stats.hpp"
+#include "index_utils.hpp"
+#include "io_utils.hpp"
 #include "kmer_utils.hpp"
+#include "memory_utils.hpp"
 
 using namespace std;
 
 auto start_t = chrono::high_resolution_clock::now();
 
+StatsCollector run_stats;
+
 void pelapsed(const string &s = "") {
   auto now_t = chrono::high_resolution_clock::now();
   cerr << "[shark/" << s << "] Time elapsed "
@@ -55,87 +69,232 @@ void pelapsed(const string &s = "") {
 
 
 void reference_1st_pass(FastaSplitter& fs, KmerBuilder& kb, BloomfilterFiller& bff) {
+  stats_t stats;
   while (true) {
     vector<pair<string, string>>* r_fs = fs();
-    if (r_fs == nullptr) return;
+    if (r_fs == nullptr) break;
     vector<uint64_t>* r_kb = kb(r_fs);
+    stats.reference_kmers += r_kb->size();
     bff(r_kb);
   }
+  run_stats.merge(stats);
 }
 
-void read_analysis(FastqSplitter& fs, ReadAnalyzer& ra, ReadOutput& ro) {
-  FastqSplitter::output_t reads;
-  ReadAnalyzer::output_t associations;
+void reference_estimate(FastaSplitter& fs, KmerBuilder& kb, HyperLogLog& hll, std::mutex& mtx) {
+  HyperLogLog local;
   while (true) {
-    fs(reads);
-    if (reads.empty()) return;
-    ra(reads, associations);
-    ro(associations);
-    reads.clear();
-    associations.clear();
+    vector<pair<string, string>>* r_fs = fs();
+    if (r_fs == nullptr) break;
+    vector<uint64_t>* r_kb = kb(r_fs);
+    for (const auto h : *r_kb)
+      local.add(h);
+    delete r_kb;
   }
+  std::lock_guard<std::mutex> lock(mtx);
+  hll.merge(local);
 }
 
+/**
+ * First pass and estimate on a mapped reference: units of the records
+ * are taken in turn, and their k-mers hashed in a buffer reused by the
+ * thread.
+ **/
+void reference_1st_pass_mapped(const MappedFasta& mf, const vector<MappedFasta::unit_t>& units,
+                               atomic<size_t>& next, BloomfilterFiller& bff) {
+  stats_t stats;
+  vector<uint64_t> hashes;
+  for (size_t i; (i = next++) < units.size(); ) {
+    hashes.clear();
+    mf.for_each_kmer(mf.records()[units[i].record], units[i].from, units[i].to, opt::k,
+                     [&](const uint64_t kmer) { hashes.push_back(_get_hash(kmer)); });
+    stats.reference_kmers += hashes.size();
+    bff(hashes);
+  }
+  run_stats.merge(stats);
+}
 
-/*****************************************
- * Main
- *****************************************/
-int main(int argc, char *argv[]) {
-  parse_arguments(argc, argv);
+void reference_estimate_mapped(const MappedFasta& mf, const vector<MappedFasta::unit_t>& units,
+                               atomic<size_t>& next, HyperLogLog& hll, std::mutex& mtx) {
+  HyperLogLog local;
+  for (size_t i; (i = next++) < units.size(); )
+    mf.for_each_kmer(mf.records()[units[i].record], units[i].from, units[i].to, opt::k,
+                     [&](const uint64_t kmer) { local.add(_get_hash(kmer)); });
+  std::lock_guard<std::mutex> lock(mtx);
+  hll.merge(local);
+}
 
-  /*** 0. Check input files and initialize variables **************************/
-  // Transcripts
-  gzFile ref_file = gzopen(opt::fasta_path.c_str(), "r");
-  kseq_t *seq = kseq_init(ref_file);
-  kseq_destroy(seq);
+/**
+ * Estimates the number of distinct canonical k-mers of the reference
+ * (HyperLogLog over the same hashes inserted in the Bloom filter).
+ **/
+double estimate_kmers(const string &fasta_path) {
+  MappedFasta mf;
+  if (mf.open(fasta_path)) {
+    const vector<MappedFasta::unit_t> units = mf.units(FastaSplitter::CHUNK_LEN);
+    atomic<size_t> next(0);
+    HyperLogLog hll;
+    std::mutex mtx;
+    std::vector<std::thread> threads;
+    while (static_cast<int>(threads.size()) < opt::nThreads)
+      threads.emplace_back(reference_estimate_mapped, std::cref(mf), std::cref(units), std::ref(next),
+                           std::ref(hll), std::ref(mtx));
+    for (auto& t: threads)
+      t.join();
+    const double n = hll.estimate();
+    pelapsed("Estimated " + to_string(static_cast<uint64_t>(n)) + " distinct k-mers");
+    return n;
+  }
+
+  gzFile ref_file = open_input(fasta_path, ">");
+  kseq_t *refseq = kseq_init(ref_file);
+
+  FastaSplitter fs(refseq, 100, nullptr, FastaSplitter::CHUNK_LEN, opt::k - 1);
+  KmerBuilder kb(opt::k);
+  HyperLogLog hll;
+  std::mutex mtx;
+
+  std::vector<std::thread> threads;
+  while (static_cast<int>(threads.size()) < opt::nThreads)
+    threads.emplace_back(reference_estimate, std::ref(fs), std::ref(kb), std::ref(hll), std::ref(mtx));
+  for (auto& t: threads)
+    t.join();
+
+  kseq_destroy(refseq);
   gzclose(ref_file);
 
-  // Sample 1
-  gzFile read1_file = gzopen(opt::sample1_path.c_str(), "r");
-  seq = kseq_init(read1_file);
-  kseq_destroy(seq);
-  gzclose(read1_file);
-
-  // Sample 2
-  gzFile read2_file = nullptr;
-  if(opt::paired_flag) {
-    read2_file = gzopen(opt::sample2_path.c_str(), "r");
-    seq = kseq_init(read2_file);
-    kseq_destroy(seq);
-    gzclose(read2_file);
-  }
+  const double n = hll.estimate();
+  pelapsed("Estimated " + to_string(static_cast<uint64_t>(n)) + " distinct k-mers");
+  return n;
+}
 
-  BF bloom(opt::bf_size);
-  vector<string> legend_ID;
-  legend_ID.reserve(100);
-  int seq_len;
+/**
+ * Plans the index of fasta_path and the analysis of the samples by
+ * threads threads. Unless its size is given (-b) or the index is a
+ * saved one, the filter is sized on an estimate of the number of
+ * distinct k-mers. With a memory budget (--max-memory), the filter and
+ * the batches of reads are fit into it, and we abort if this is not
+ * possible.
+ **/
+memory_plan_t plan_run(const string &fasta_path, uint64_t budget, const int threads, const bool paired) {
+  memory_plan_t plan = { opt::bf_size, memory_plan::BATCH_SIZE, threads,
+                         opt::tmp_dir != "" ? memory_plan::RUN_SIZE : 0, opt::offsets, 0, 0,
+                         threads > 0 ? opt::read_cache : 0, 0 };
+#ifdef SHARK_IO_URING
+  // the current and the next sample may be open, each with its inputs and outputs
+  if (threads > 0)
+    plan.io_bytes = 2 * (paired ? 4 : 2) * async_io::QUEUE_DEPTH * async_io::BLOCK_BYTES;
+#endif
+  // the cache of verdicts takes at most an eighth of the budget
+  if (budget != 0) {
+    if (plan.io_bytes >= budget) {
+      cerr << "shark: about " << gigabytes(plan.io_bytes) << " are needed for the asynchronous I/O"
+           << " but the memory budget is " << gigabytes(budget) << "." << endl
+           << "aborting..." << endl;
+      exit(EXIT_FAILURE);
+    }
+    budget -= plan.io_bytes;
+    plan.read_cache_bytes = min(plan.read_cache_bytes, budget / 8);
+    budget -= plan.read_cache_bytes;
+  }
+  string error;
+  index_header_t header;
+  const bool saved = is_index(fasta_path) && try_read_index_header(fasta_path, header, error);
+  if (saved) plan.bf_size = header.bf_size;
+  if (plan.bf_size != 0 && budget == 0) return plan;
+
+  const double kmers = saved ? header.ids : estimate_kmers(fasta_path);
+  if (plan.bf_size == 0) plan.bf_size = bf_bits_for(kmers, opt::bf_fpr);
+  if (budget == 0) return plan;
+
+  if (!plan_memory(budget, kmers, plan.bf_size, opt::bf_size != 0 || saved, threads, paired, plan, error)) {
+    cerr << "shark: " << error << "." << endl
+         << "aborting..." << endl;
+    exit(EXIT_FAILURE);
+  }
+  pelapsed("Memory plan: index " + gigabytes(plan.index_bytes) + " (Bloom filter of " + to_string(plan.bf_size)
+           + " bits), reads " + gigabytes(plan.reads_bytes) + " (" + to_string(plan.max_batches) + " batches of "
+           + to_string(plan.batch_size) + ")"
+           + (plan.io_bytes > 0 ? ", asynchronous I/O " + gigabytes(plan.io_bytes) : ""));
+  return plan;
+}
 
-  if(opt::verbose) {
-    cerr << "Reference texts: " << opt::fasta_path << endl;
-    cerr << "Sample 1: " << opt::sample1_path << endl;
-    if(opt::paired_flag)
-      cerr << "Sample 2: " << opt::sample2_path << endl;
-    cerr << "K-mer length: " << opt::k << endl;
-    cerr << "Threshold value: " << opt::c << endl;
-    cerr << "Only single associations: " << (opt::single ? "Yes" : "No") << endl;
-    cerr << "Minimum base quality: " << static_cast<int>(opt::min_quality) << endl;
-    cerr << endl;
+/**
+ * Transcripts are read twice, hence they must come from a regular
+ * file. A saved index is used with the k-mer size it was built with,
+ * which must be the same for all the indexes of a run.
+ **/
+void check_reference(const string &fasta_path) {
+  static bool saved_k = false;
+  if (is_index(fasta_path)) {
+    index_header_t header;
+    string error;
+    if (!try_read_index_header(fasta_path, header, error)) {
+      cerr << "shark: " << error << "." << endl
+           << "aborting..." << endl;
+      exit(EXIT_FAILURE);
+    }
+    if (saved_k && header.k != opt::k) {
+      cerr << "shark: the indexes have been built with different k-mer sizes." << endl
+           << "aborting..." << endl;
+      exit(EXIT_FAILURE);
+    }
+    saved_k = true;
+    opt::k = header.k;
+    if (opt::window > 0 && opt::window < opt::k) {
+      cerr << "shark: the window must be at least as long as the k-mers of the index (" << opt::k << " bases)." << endl
+           << "aborting..." << endl;
+      exit(EXIT_FAILURE);
+    }
+    return;
   }
+  struct stat ref_stat;
+  if (fasta_path == "-" || (stat(fasta_path.c_str(), &ref_stat) == 0 && !S_ISREG(ref_stat.st_mode))) {
+    cerr << "shark: the reference must be a regular file (it is read twice)." << endl
+         << "aborting..." << endl;
+    exit(EXIT_FAILURE);
+  }
+  gzclose(open_input(fasta_path, ">"));
+}
 
-  /****************************************************************************/
+/**
+ * Builds the index of the transcripts in fasta_path, as planned: the
+ * first iteration fills the Bloom filter, the second one associates
+ * the indexes of the transcripts (stored in legend_ID) to each k-mer.
+ **/
+BF *build_index(const string &fasta_path, vector<string> &legend_ID, const memory_plan_t &plan) {
+  BF *const index = new BF(plan.bf_size);
+  BF &bloom = *index;
+  if (plan.run_size > 0)
+    bloom.use_external_memory(opt::tmp_dir, plan.run_size);
+
+  // Uncompressed references are mapped and k-merised in place
+  MappedFasta mf;
+  const bool mapped = mf.open(fasta_path);
 
   /*** 1. First iteration over transcripts ************************************/
-  {
-    ref_file = gzopen(opt::fasta_path.c_str(), "r");
+  if (mapped) {
+    for (const auto &r : mf.records())
+      legend_ID.push_back(mf.name(r));
+    const vector<MappedFasta::unit_t> units = mf.units(FastaSplitter::CHUNK_LEN);
+    atomic<size_t> next(0);
+    BloomfilterFiller bff(&bloom);
+
+    std::vector<std::thread> threads;
+    while (static_cast<int>(threads.size()) < opt::nThreads)
+      threads.emplace_back([&, i = threads.size()] { pin_thread(i); reference_1st_pass_mapped(mf, units, next, bff); });
+    for (auto& t: threads)
+      t.join();
+  } else {
+    gzFile ref_file = open_input(fasta_path, ">");
     kseq_t *refseq = kseq_init(ref_file);
 
-    FastaSplitter fs(refseq, 100, &legend_ID);
+    FastaSplitter fs(refseq, 100, &legend_ID, FastaSplitter::CHUNK_LEN, opt::k - 1);
     KmerBuilder kb(opt::k);
     BloomfilterFiller bff(&bloom);
 
     std::vector<std::thread> threads;
     while (static_cast<int>(threads.size()) < opt::nThreads)
-      threads.emplace_back(reference_1st_pass, std::ref(fs), std::ref(kb), std::ref(bff));
+      threads.emplace_back([&, i = threads.size()] { pin_thread(i); reference_1st_pass(fs, kb, bff); });
     for (auto& t: threads)
       t.join();
 
@@ -149,89 +308,319 @@ int main(int argc, char *argv[]) {
 
   pelapsed("First switch performed");
   /****************************************************************************/
-                                                                        \
+
   /*** 2. Second iteration over transcripts ***********************************/
-  ref_file = gzopen(opt::fasta_path.c_str(), "r");
-  seq = kseq_init(ref_file);
   int nidx = 0;
-  // open and read the .fa, every time a kmer is found the relative index is
-  // added to BF
   vector<uint64_t> kmers;
-  while ((seq_len = kseq_read(seq)) >= 0) {
-    kmers.clear();
-
-    if ((uint)seq_len >= opt::k) {
-      int _p = 0;
-      uint64_t kmer = build_kmer(seq->seq.s, _p, opt::k);
-      if(kmer == (uint64_t)-1) continue;
-      uint64_t rckmer = revcompl(kmer, opt::k);
-      kmers.push_back(min(kmer, rckmer));
-      for (int p = _p; p < seq_len; ++p) {
-        uint8_t new_char = to_int[seq->seq.s[p]];
-        if(new_char == 0) { // Found a char different from A, C, G, T
-          ++p; // we skip this character then we build a new kmer
-          kmer = build_kmer(seq->seq.s, p, opt::k);
-          if(kmer == (uint64_t)-1) break;
-          rckmer = revcompl(kmer, opt::k);
-          --p; // p must point to the ending position of the kmer, it will be incremented by the for
-        } else {
-          --new_char; // A is 1 but it should be 0
-          kmer = lsappend(kmer, new_char, opt::k);
-          rckmer = rsprepend(rckmer, reverse_char(new_char), opt::k);
-        }
+  if (mapped) {
+    for (const auto &r : mf.records()) {
+      kmers.clear();
+      mf.for_each_kmer(r, r.seq_begin, r.seq_end, opt::k, [&](const uint64_t kmer) { kmers.push_back(kmer); });
+      if (!kmers.empty())
+        bloom.add_to_kmer(kmers, nidx);
+      ++nidx;
+    }
+  } else {
+    gzFile ref_file = open_input(fasta_path, ">");
+    kseq_t *seq = kseq_init(ref_file);
+    int seq_len;
+    // open and read the .fa, every time a kmer is found the relative index is
+    // added to BF
+    while ((seq_len = kseq_read(seq)) >= 0) {
+      kmers.clear();
+
+      if ((uint)seq_len >= opt::k) {
+        int _p = 0;
+        uint64_t kmer = build_kmer(seq->seq.s, _p, opt::k);
+        if(kmer == (uint64_t)-1) { ++nidx; continue; }
+        uint64_t rckmer = revcompl(kmer, opt::k);
         kmers.push_back(min(kmer, rckmer));
+        for (int p = _p; p < seq_len; ++p) {
+          uint8_t new_char = to_int[seq->seq.s[p]];
+          if(new_char == 0) { // Found a char different from A, C, G, T
+            ++p; // we skip this character then we build a new kmer
+            kmer = build_kmer(seq->seq.s, p, opt::k);
+            if(kmer == (uint64_t)-1) break;
+            rckmer = revcompl(kmer, opt::k);
+            --p; // p must point to the ending position of the kmer, it will be incremented by the for
+          } else {
+            --new_char; // A is 1 but it should be 0
+            kmer = lsappend(kmer, new_char, opt::k);
+            rckmer = rsprepend(rckmer, reverse_char(new_char), opt::k);
+          }
+          kmers.push_back(min(kmer, rckmer));
+        }
+        bloom.add_to_kmer(kmers, nidx);
       }
-      bloom.add_to_kmer(kmers, nidx);
+      ++nidx;
     }
-    ++nidx;
+    kseq_destroy(seq);
+    gzclose(ref_file);
   }
-  kseq_destroy(seq);
-  gzclose(ref_file);
 
   pelapsed("BF created from transcripts (" + to_string(nidx) + " genes)");
 
   bloom.switch_mode(2);
   pelapsed("Second switch performed");
-
+  if (plan.offsets && bloom.build_offsets())
+    pelapsed("Offset array built");
   /****************************************************************************/
+  return index;
+}
 
-  /*** 3. Iteration over the sample *****************************************/
-  {
-    kseq_t *sseq1 = nullptr, *sseq2 = nullptr;
-    FILE *out1 = nullptr, *out2 = nullptr;
-    read1_file = gzopen(opt::sample1_path.c_str(), "r");
-    sseq1 = kseq_init(read1_file);
-    if (opt::out1_path != "") {
-      out1 = fopen(opt::out1_path.c_str(), "w");
-    }
-    if(opt::paired_flag) {
-      read2_file = gzopen(opt::sample2_path.c_str(), "r");
-      sseq2 = kseq_init(read2_file);
-      if (opt::out2_path != "") {
-        out2 = fopen(opt::out2_path.c_str(), "w");
+/**
+ * Loads the index saved in path or, if path is a FASTA file, builds it
+ * as planned (with its offset array, if planned).
+ **/
+BF *open_index(const string &path, vector<string> &legend_ID, const memory_plan_t &plan) {
+  if (!is_index(path))
+    return build_index(path, legend_ID, plan);
+  index_header_t header;
+  string error;
+  BF *index = try_load_index(path, header, error);
+  if (index == nullptr) {
+    cerr << "shark: " << error << "." << endl
+         << "aborting..." << endl;
+    exit(EXIT_FAILURE);
+  }
+  legend_ID = header.legend_ID;
+  pelapsed("Index loaded (" + to_string(legend_ID.size()) + " genes)");
+  if (plan.offsets && index->build_offsets())
+    pelapsed("Offset array built");
+  return index;
+}
+
+/**
+ * Builds (or loads) the index of each reference and merges them, in
+ * order, into the index saved in index_path. Transcripts are numbered
+ * after those of the previous references, so that adding genes to a
+ * saved index only costs the index of the new ones and a merge. All
+ * the filters must have the same size: the one of the saved indexes,
+ * if any, otherwise the one planned for all the references.
+ **/
+int save_merged_index(const vector<string> &paths, const string &index_path) {
+  memory_plan_t plan = { opt::bf_size, memory_plan::BATCH_SIZE, 0,
+                         opt::tmp_dir != "" ? memory_plan::RUN_SIZE : 0, false, 0, 0, 0, 0 };
+  double kmers = 0;
+  for (const auto &path : paths) {
+    index_header_t header;
+    string error;
+    if (is_index(path) && try_read_index_header(path, header, error)) {
+      if (plan.bf_size != 0 && plan.bf_size != header.bf_size) {
+        cerr << "shark: " << path << " has a Bloom filter of a different size (" << header.bf_size
+             << " bits instead of " << plan.bf_size << ")." << endl
+             << "aborting..." << endl;
+        exit(EXIT_FAILURE);
       }
+      plan.bf_size = header.bf_size;
+    }
+  }
+  if (plan.bf_size == 0) {
+    for (const auto &path : paths)
+      kmers += estimate_kmers(path);
+    plan.bf_size = bf_bits_for(kmers, opt::bf_fpr);
+  }
+
+  unique_ptr<BF> merged;
+  vector<string> legend_ID;
+  for (const auto &path : paths) {
+    vector<string> part_ID;
+    unique_ptr<BF> part(open_index(path, part_ID, plan));
+    if (legend_ID.size() + part_ID.size() > 65536) {
+      cerr << "shark: an index can hold at most 65536 transcripts." << endl
+           << "aborting..." << endl;
+      exit(EXIT_FAILURE);
+    }
+    if (merged) {
+      merged.reset(BF::merge(*merged, *part, legend_ID.size()));
+      pelapsed("Index of " + path + " merged");
+    } else {
+      merged.swap(part);
+    }
+    legend_ID.insert(legend_ID.end(), part_ID.begin(), part_ID.end());
+  }
+
+  string error;
+  if (!try_save_index(index_path, opt::k, legend_ID, *merged, error)) {
+    cerr << "shark: " << error << "." << endl
+         << "aborting..." << endl;
+    exit(EXIT_FAILURE);
+  }
+  pelapsed("Index saved (" + to_string(legend_ID.size()) + " genes)");
+  return 0;
+}
+
+void sample_analysis(SampleScheduler& ss, ReadAnalyzer& ra) {
+  stats_t stats;
+  for (size_t i = 0; i < ss.size(); ++i) {
+    SampleJob *job = ss.enter(i);
+    if (job == nullptr) continue;
+    job->run(ra, stats);
+    const string error = job->error();
+    if (!ss.leave(i)) continue;
+    if (!error.empty()) {
+      cerr << "shark: " << error << "." << endl
+           << "aborting..." << endl;
+      exit(EXIT_FAILURE);
+    }
+    if (opt::verbose)
+      pelapsed("Sample " + to_string(i + 1) + "/" + to_string(ss.size()) + " completed");
+  }
+  run_stats.merge(stats);
+}
+
+
+/*****************************************
+ * Main
+ *****************************************/
+int main(int argc, char *argv[]) {
+  parse_arguments(argc, argv);
+
+  memory_policy::settings().huge_pages = opt::huge_pages;
+  memory_policy::settings().interleave = opt::numa;
+  if (opt::huge_pages == memory_policy::EXPLICIT_HUGE_PAGES) {
+    try {
+      sdsl::memory_manager::use_hugepages();
+    } catch (const std::exception &e) {
+      cerr << "shark: explicit huge pages are not available (" << e.what() << "), using transparent ones." << endl;
+      memory_policy::settings().huge_pages = memory_policy::TRANSPARENT_HUGE_PAGES;
     }
+  }
 
-    FastqSplitter fs(sseq1, sseq2, 50000, opt::min_quality, out1 != nullptr);
-    ReadAnalyzer ra(&bloom, legend_ID, opt::k, opt::c, opt::single);
-    ReadOutput ro(out1, out2);
+  if (opt::command == "submit")
+    return submit_job(opt::socket_path, opt::index_name,
+                      { opt::sample1_path, opt::sample2_path, opt::out1_path, opt::out2_path, "" },
+                      opt::c, opt::min_quality, opt::single, opt::stride, opt::window);
+
+  if (opt::command == "index") {
+    for (const auto &path : opt::fasta_paths)
+      check_reference(path);
+    return save_merged_index(opt::fasta_paths, opt::out1_path);
+  }
+
+  if (opt::command == "serve") {
+    for (const auto &path : opt::fasta_paths)
+      check_reference(path);
+    // The budget is shared by the indexes, the last one also accounts for the reads
+    vector<memory_plan_t> plans;
+    uint64_t budget = opt::max_memory;
+    for (size_t i = 0; i < opt::fasta_paths.size(); ++i) {
+      const bool last = i + 1 == opt::fasta_paths.size();
+      plans.push_back(plan_run(opt::fasta_paths[i], budget, last ? opt::nThreads : 0, true));
+      if (budget != 0)
+        budget = budget > plans.back().index_bytes ? budget - plans.back().index_bytes : 1;
+    }
+    Server server(opt::socket_path, plans.back().max_batches, plans.back().batch_size, plans.back().read_cache_bytes,
+                  opt::kmer_cache, opt::verbose);
+    for (size_t i = 0; i < opt::fasta_paths.size(); ++i) {
+      Server::index_t &index = server.add_index(opt::fasta_paths[i], opt::k);
+      index.bloom.reset(open_index(opt::fasta_paths[i], index.legend_ID, plans[i]));
+    }
+    return server.run();
+  }
+
+  /*** 0. Check input files and initialize variables **************************/
+  check_reference(opt::fasta_path);
+
+  // Samples are opened once, and kept open until they are analyzed, so
+  // that they can be streamed from stdin or from named pipes. In batch
+  // mode, only the first sample is opened now, the others are checked
+  // to be readable and opened when their turn comes
+  vector<sample_t> samples;
+  if (opt::manifest_path != "") {
+    samples = read_manifest(opt::manifest_path);
+    for (const auto &s : samples) {
+      for (const auto &path : { s.sample1, s.sample2 }) {
+        if (path != "" && access(path.c_str(), R_OK) != 0) {
+          cerr << "shark: cannot open " << input_name(path) << "." << endl
+               << "aborting..." << endl;
+          exit(EXIT_FAILURE);
+        }
+      }
+    }
+  } else {
+    if (opt::sample1_path == "-" && opt::sample2_path == "-") {
+      cerr << "shark: only one sample can be read from standard input." << endl
+           << "aborting..." << endl;
+      exit(EXIT_FAILURE);
+    }
+    samples.push_back({ opt::sample1_path, opt::sample2_path, opt::out1_path, opt::out2_path, "" });
+  }
+  bool paired = false;
+  for (const auto &s : samples)
+    paired = paired || s.sample2 != "";
+  const memory_plan_t plan = plan_run(opt::fasta_path, opt::max_memory, opt::nThreads, paired);
+
+  SampleScheduler scheduler(samples, plan.batch_size, plan.max_batches, opt::min_quality);
+  if (!samples.empty())
+    scheduler.open(0);
+
+  unique_ptr<BF> bloom;
+  vector<string> legend_ID;
+  legend_ID.reserve(100);
+
+  if(opt::verbose) {
+    cerr << "Reference texts: " << opt::fasta_path << endl;
+    if (opt::manifest_path != "") {
+      cerr << "Samples: " << samples.size() << " (from " << opt::manifest_path << ")" << endl;
+    } else {
+      cerr << "Sample 1: " << opt::sample1_path << endl;
+      if(opt::paired_flag)
+        cerr << "Sample 2: " << opt::sample2_path << endl;
+    }
+    cerr << "K-mer length: " << opt::k << endl;
+    cerr << "Threshold value: " << opt::c << endl;
+    cerr << "Only single associations: " << (opt::single ? "Yes" : "No") << endl;
+    cerr << "Stride: " << opt::stride << endl;
+    cerr << "Window: " << opt::window << endl;
+    cerr << "Minimum base quality: " << static_cast<int>(opt::min_quality) << endl;
+    cerr << "Read cache: " << gigabytes(plan.read_cache_bytes) << endl;
+    cerr << endl;
+  }
+
+  /****************************************************************************/
+
+  /*** 1-2. Iterations over transcripts ***************************************/
+  // Meanwhile, the first sample is read (and decompressed) in the background
+  stats_t prefetch_stats;
+  std::thread prefetcher;
+  if (!samples.empty())
+    prefetcher = std::thread([&] { scheduler.prefetch(0, prefetch_stats); });
+
+  const auto index_start = chrono::steady_clock::now();
+  bloom.reset(open_index(opt::fasta_path, legend_ID, plan));
+  const double index_s = elapsed_ns(index_start) / 1e9;
+
+  if (prefetcher.joinable())
+    prefetcher.join();
+  run_stats.merge(prefetch_stats);
+  /****************************************************************************/
+
+  /*** 3. Iteration over the samples ****************************************/
+  const auto analysis_start = chrono::steady_clock::now();
+  {
+    ReadAnalyzer ra(bloom.get(), legend_ID, opt::k, opt::c, opt::single, plan.read_cache_bytes,
+                    opt::kmer_cache, opt::counts_path != "", opt::stride, opt::window);
 
     std::vector<std::thread> threads;
-    while (static_cast<int>(threads.size()) < opt::nThreads)
-      threads.emplace_back(read_analysis, std::ref(fs), std::ref(ra), std::ref(ro));
+    while (static_cast<int>(threads.size()) < plan.max_batches)
+      threads.emplace_back([&, i = threads.size()] { pin_thread(i); sample_analysis(scheduler, ra); });
     for (auto& t: threads)
       t.join();
+  }
+  pelapsed("Samples completed");
 
-    kseq_destroy(sseq1);
-    gzclose(read1_file);
-    if(opt::paired_flag) {
-      kseq_destroy(sseq2);
-      gzclose(read2_file);
-    }
-    if (out1 != nullptr) fclose(out1);
-    if (out2 != nullptr) fclose(out2);
+  if (opt::counts_path != "" && !run_stats.write_gene_counts(opt::counts_path, legend_ID)) {
+    cerr << "shark: cannot write " << opt::counts_path << "." << endl
+         << "aborting..." << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  if (opt::stats_path != "" &&
+      !run_stats.write_json(opt::stats_path, bloom->size(), bloom->bits_set(), bloom->ids(), legend_ID.size(),
+                            opt::nThreads, index_s, elapsed_ns(analysis_start) / 1e9)) {
+    cerr << "shark: cannot write " << opt::stats_path << "." << endl;
   }
-  pelapsed("Sample completed");
 
   /****************************************************************************/
 
@@ -0,0 +1,252 @@
+/**
+ * shark - Mapping-free filtering of useless RNA-Seq reads
+ * Copyright (C) 2020 Tamara Ceccato, Luca Denti, Yuri Pirola, Marco Previtali
+ *
+ * This file is part of shark.
+ *
+ * shark is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * shark is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with shark; see the file LICENSE. If not, see
+ * <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef _MEMORY_UTILS_HPP
+#define _MEMORY_UTILS_HPP
+
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+/**
+ * Placement of the large arrays of the index (Bloom filter, ids):
+ *  - huge_pages: back them with transparent huge pages (madvise) or
+ *    with explicit ones (MAP_HUGETLB, falling back to transparent ones
+ *    when the pool is empty)
+ *  - interleave: spread their pages over all NUMA nodes, so that the
+ *    random lookups of threads running on any node are balanced
+ **/
+namespace memory_policy {
+  enum huge_pages_t { NO_HUGE_PAGES, TRANSPARENT_HUGE_PAGES, EXPLICIT_HUGE_PAGES };
+  struct settings_t {
+    huge_pages_t huge_pages = NO_HUGE_PAGES;
+    bool interleave = false;
+  };
+  // Smaller allocations are left to the standard allocator
+  const size_t MIN_BYTES = (size_t)1 << 21;
+
+  // The policy, shared by all the translation units
+  inline settings_t &settings() {
+    static settings_t s;
+    return s;
+  }
+
+  // Blocks mapped by policy_allocator, so that they are released as they were allocated
+  struct mapped_blocks_t {
+    std::mutex mtx;
+    unordered_set<void *> blocks;
+  };
+
+  // Never destroyed, as containers with static storage can release their blocks after it
+  inline mapped_blocks_t &mapped_blocks() {
+    static mapped_blocks_t *const b = new mapped_blocks_t();
+    return *b;
+  }
+}
+
+// Parses a cpu/node list of /sys, e.g. "0-3,8,10-11"
+inline vector<int> parse_sys_list(const string &list) {
+  vector<int> ids;
+  istringstream ranges(list);
+  string range;
+  while (getline(ranges, range, ',')) {
+    if (range.empty()) continue;
+    const size_t dash = range.find('-');
+    const int first = atoi(range.c_str());
+    const int last = dash == string::npos ? first : atoi(range.c_str() + dash + 1);
+    for (int i = first; i <= last; ++i) ids.push_back(i);
+  }
+  return ids;
+}
+
+// CPUs of each online NUMA node (a single node with no CPU list if unknown)
+inline const vector<pair<int, vector<int>>> &numa_nodes() {
+  static const vector<pair<int, vector<int>>> nodes = [] {
+    vector<pair<int, vector<int>>> n;
+    string line;
+    ifstream online("/sys/devices/system/node/online");
+    if (getline(online, line)) {
+      for (const int node : parse_sys_list(line)) {
+        ifstream cpus("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+        string cpulist;
+        getline(cpus, cpulist);
+        n.emplace_back(node, parse_sys_list(cpulist));
+      }
+    }
+    if (n.empty()) n.emplace_back(0, vector<int>());
+    return n;
+  }();
+  return nodes;
+}
+
+/**
+ * Size of the last-level (data or unified) cache of the CPUs, from
+ * /sys or sysconf, 32MB if unknown.
+ **/
+inline size_t last_level_cache_bytes() {
+  static const size_t bytes = [] {
+    size_t llc = 0;
+    int llc_level = 0;
+    for (int i = 0; ; ++i) {
+      const string dir = "/sys/devices/system/cpu/cpu0/cache/index" + to_string(i) + "/";
+      ifstream level_file(dir + "level"), type_file(dir + "type"), size_file(dir + "size");
+      int level = 0;
+      string type, size;
+      if (!(level_file >> level) || !(size_file >> size)) break;
+      if (type_file >> type && type == "Instruction") continue;
+      char *unit;
+      size_t b = strtoull(size.c_str(), &unit, 10);
+      if (*unit == 'K') b <<= 10;
+      else if (*unit == 'M') b <<= 20;
+      else if (*unit == 'G') b <<= 30;
+      if (level > llc_level || (level == llc_level && b > llc)) {
+        llc_level = level;
+        llc = b;
+      }
+    }
+    if (llc == 0) {
+      const long l3 = sysconf(_SC_LEVEL3_CACHE_SIZE), l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+      llc = l3 > 0 ? l3 : l2 > 0 ? l2 : 0;
+    }
+    return llc == 0 ? (size_t)32 << 20 : llc;
+  }();
+  return bytes;
+}
+
+// Interleaves the pages of [p, p+bytes) over all nodes, moving the ones already allocated
+inline void interleave_pages(void *p, const size_t bytes, const unsigned flags) {
+  const auto &nodes = numa_nodes();
+  if (nodes.size() < 2) return;
+  unsigned long mask[4] = { 0, 0, 0, 0 };
+  for (const auto &node : nodes)
+    if (node.first < 256) mask[node.first / 64] |= 1UL << (node.first % 64);
+  syscall(SYS_mbind, p, bytes, MPOL_INTERLEAVE, mask, 256 + 1, flags);
+}
+
+/**
+ * Applies the policy to memory already allocated (and possibly already
+ * touched) by another allocator, e.g. the sdsl bit vectors: only the
+ * whole pages inside the range are affected.
+ **/
+inline void apply_memory_policy(void *p, const size_t bytes) {
+  const uintptr_t page = (uintptr_t)1 << 21;
+  const uintptr_t begin = ((uintptr_t)p + page - 1) & ~(page - 1);
+  const uintptr_t end = ((uintptr_t)p + bytes) & ~(page - 1);
+  const memory_policy::settings_t &policy = memory_policy::settings();
+  if (bytes < memory_policy::MIN_BYTES || end <= begin) return;
+  if (policy.huge_pages != memory_policy::NO_HUGE_PAGES)
+    madvise((void *)begin, end - begin, MADV_HUGEPAGE);
+  if (policy.interleave)
+    interleave_pages((void *)begin, end - begin, MPOL_MF_MOVE);
+}
+
+/**
+ * Allocator placing large arrays according to the memory policy. Pages
+ * are mapped directly, so that the policy is set before they are
+ * touched for the first time. As the policy can change between the
+ * allocation and the release of a block (e.g. in server mode), the
+ * mapped blocks are recorded, and deallocate looks them up.
+ **/
+template <typename T>
+struct policy_allocator {
+  typedef T value_type;
+
+  policy_allocator() = default;
+  template <typename U> policy_allocator(const policy_allocator<U> &) {}
+
+  T *allocate(const size_t n) {
+    const size_t bytes = n * sizeof(T);
+    const memory_policy::settings_t policy = memory_policy::settings();
+    if (bytes < memory_policy::MIN_BYTES ||
+        (policy.huge_pages == memory_policy::NO_HUGE_PAGES && !policy.interleave))
+      return static_cast<T *>(::operator new(bytes));
+    void *p = MAP_FAILED;
+    if (policy.huge_pages == memory_policy::EXPLICIT_HUGE_PAGES)
+      p = mmap(nullptr, mapped_bytes(bytes), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p == MAP_FAILED) {
+      p = mmap(nullptr, mapped_bytes(bytes), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED) throw std::bad_alloc();
+      if (policy.huge_pages != memory_policy::NO_HUGE_PAGES)
+        madvise(p, mapped_bytes(bytes), MADV_HUGEPAGE);
+    }
+    if (policy.interleave)
+      interleave_pages(p, mapped_bytes(bytes), 0);
+    memory_policy::mapped_blocks_t &mapped = memory_policy::mapped_blocks();
+    std::lock_guard<std::mutex> lock(mapped.mtx);
+    mapped.blocks.insert(p);
+    return static_cast<T *>(p);
+  }
+
+  void deallocate(T *p, const size_t n) {
+    const size_t bytes = n * sizeof(T);
+    bool was_mapped = false;
+    if (bytes >= memory_policy::MIN_BYTES) {
+      memory_policy::mapped_blocks_t &mapped = memory_policy::mapped_blocks();
+      std::lock_guard<std::mutex> lock(mapped.mtx);
+      was_mapped = mapped.blocks.erase(p) != 0;
+    }
+    if (was_mapped)
+      munmap(p, mapped_bytes(bytes));
+    else
+      ::operator delete(p);
+  }
+
+  static size_t mapped_bytes(const size_t bytes) {
+    return (bytes + memory_policy::MIN_BYTES - 1) & ~(memory_policy::MIN_BYTES - 1);
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const policy_allocator<T> &, const policy_allocator<U> &) { return true; }
+template <typename T, typename U>
+bool operator!=(const policy_allocator<T> &, const policy_allocator<U> &) { return false; }
+
+/**
+ * Pins the i-th worker thread to the CPUs of a NUMA node, assigning
+ * threads to nodes round-robin (no-op on single-node machines).
+ **/
+inline void pin_thread(const size_t i) {
+  const auto &nodes = numa_nodes();
+  if (!memory_policy::settings().interleave || nodes.size() < 2) return;
+  const vector<int> &cpus = nodes[i % nodes.size()].second;
+  if (cpus.empty()) return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (const int cpu : cpus) CPU_SET(cpu, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+#endif
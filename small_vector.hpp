@@ -19,9 +19,91 @@
  * <https://www.gnu.org/licenses/>.
  **/
 
+#include <algorithm>
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <memory>
 #include <vector>
 
+/**
+ * Overflow list of a small_vector_t: the ids follow the header in
+ * the same block, whose capacity is a power of 2.
+ **/
+struct small_vector_block_t {
+  uint32_t size;
+  uint32_t capacity;
+  uint16_t arr[4];
+
+  static size_t bytes(const uint32_t capacity) {
+    return offsetof(small_vector_block_t, arr) + capacity * sizeof(uint16_t);
+  }
+};
+
+/**
+ * Slab arena serving the overflow lists of small_vector_t: blocks are
+ * carved out of large slabs, blocks outgrown by a list are kept in a
+ * free list per capacity and reused, and everything is released at
+ * once by clear() or by the destructor.
+ **/
+class small_vector_arena_t {
+public:
+  static const size_t SLAB_BYTES = 1 << 20;
+
+  small_vector_arena_t() : _cur(nullptr), _left(0), _free() {}
+
+  small_vector_block_t *allocate(const uint32_t capacity) {
+    const int c = _class(capacity);
+    small_vector_block_t *block = _free[c];
+    if (block != nullptr) {
+      memcpy(&_free[c], block->arr, sizeof(block));
+    } else {
+      const size_t bytes = small_vector_block_t::bytes(capacity);
+      if (bytes > _left) {
+        const size_t slab = bytes > SLAB_BYTES ? bytes : SLAB_BYTES;
+        _slabs.emplace_back(new uint64_t[slab / sizeof(uint64_t)]);
+        _cur = reinterpret_cast<char *>(_slabs.back().get());
+        _left = slab;
+      }
+      block = reinterpret_cast<small_vector_block_t *>(_cur);
+      _cur += bytes;
+      _left -= bytes;
+    }
+    block->size = 0;
+    block->capacity = capacity;
+    return block;
+  }
+
+  void release(small_vector_block_t *block) {
+    const int c = _class(block->capacity);
+    memcpy(block->arr, &_free[c], sizeof(block));
+    _free[c] = block;
+  }
+
+  void clear() {
+    std::vector<std::unique_ptr<uint64_t[]>>().swap(_slabs);
+    _cur = nullptr;
+    _left = 0;
+    std::fill(_free, _free + 32, nullptr);
+  }
+
+private:
+  // capacities are powers of 2, from 4 on
+  static int _class(const uint32_t capacity) {
+    return __builtin_ctz(capacity);
+  }
+
+  std::vector<std::unique_ptr<uint64_t[]>> _slabs;
+  char *_cur;
+  size_t _left;
+  small_vector_block_t *_free[32];
+};
+
+/**
+ * Set of 16-bit ids storing up to 3 ids inline. Longer sets are moved
+ * to a block of the arena passed to push_back, which owns the memory:
+ * small_vector_t is trivially destructible and must not outlive it.
+ **/
 struct small_vector_t {
   union {
     struct {
@@ -29,7 +111,7 @@ struct small_vector_t {
       uint8_t size;
       uint16_t arr[3];
     } s;
-    std::vector<uint16_t>* l;
+    small_vector_block_t* l;
   } v;
 
   small_vector_t() {
@@ -37,22 +119,25 @@ struct small_vector_t {
     v.s.size = 0;
   }
 
-  ~small_vector_t() {
-    if ((v.s.flag & 0x1) == 0) {
-      delete v.l;
-    }
-  }
-
-  void push_back(uint16_t x) {
+  void push_back(uint16_t x, small_vector_arena_t &arena) {
     if ((v.s.flag & 0x1) != 0) {
       if (v.s.size < 3) v.s.arr[v.s.size++] = x;
       else {
-        std::vector<uint16_t>* ptr = new std::vector<uint16_t>(v.s.arr, v.s.arr + 3);
-        ptr->push_back(x);
+        small_vector_block_t* ptr = arena.allocate(4);
+        std::copy(v.s.arr, v.s.arr + 3, ptr->arr);
+        ptr->arr[3] = x;
+        ptr->size = 4;
         v.l = ptr;
       }
     } else {
-      v.l->push_back(x);
+      if (v.l->size == v.l->capacity) {
+        small_vector_block_t* ptr = arena.allocate(v.l->capacity * 2);
+        std::copy(v.l->arr, v.l->arr + v.l->size, ptr->arr);
+        ptr->size = v.l->size;
+        arena.release(v.l);
+        v.l = ptr;
+      }
+      v.l->arr[v.l->size++] = x;
     }
   }
 
@@ -60,7 +145,7 @@ struct small_vector_t {
     if ((v.s.flag & 0x1) != 0) {
       return v.s.size;
     } else {
-      return v.l->size();
+      return v.l->size;
     }
   }
 
@@ -68,7 +153,7 @@ struct small_vector_t {
     if ((v.s.flag & 0x1) != 0) {
       return v.s.arr[v.s.size - 1];
     } else {
-      return v.l->back();
+      return v.l->arr[v.l->size - 1];
     }
   }
 
@@ -76,7 +161,7 @@ struct small_vector_t {
     if ((v.s.flag & 0x1) != 0) {
       return v.s.arr;
     } else {
-      return v.l->data();
+      return v.l->arr;
     }
   }
 
@@ -84,7 +169,7 @@ struct small_vector_t {
     if ((v.s.flag & 0x1) != 0) {
       return v.s.arr + v.s.size;
     } else {
-      return v.l->data() + v.l->size();
+      return v.l->arr + v.l->size;
     }
   }
 